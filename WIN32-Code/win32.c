@@ -45,11 +45,7 @@
 #endif
 
 #include "event.h"
-
-extern struct event_list timequeue;
-extern struct event_list eventqueue;
-extern struct event_list addqueue;
-extern struct event_list signalqueue;
+#include "event-internal.h"
 
 #define NEVENT		64
 
@@ -59,14 +55,14 @@ volatile sig_atomic_t signal_caught = 0;
 volatile double SIGFPE_REQ = 0.0f; 
 
 int signal_handler(int sig);
-void signal_process(void);
-int signal_recalc(void);
+void signal_process(struct event_base *);
+int signal_recalc(struct event_base *);
 
-void *win32_init	(void);
+void *win32_init	(struct event_base *);
 int win32_insert	(void *, struct event *);
 int win32_del	(void *, struct event *);
-int win32_recalc	(void *, int);
-int win32_dispatch	(void *, struct timeval *);
+int win32_recalc	(struct event_base *, void *, int);
+int win32_dispatch	(struct event_base *, void *, struct timeval *);
 
 struct eventop win32ops = {
 	"win32",
@@ -74,7 +70,10 @@ struct eventop win32ops = {
 	win32_insert,
 	win32_del,
 	win32_recalc,
-	win32_dispatch
+	win32_dispatch,
+	NULL,
+	0,
+	NULL
 };
 
 static int timeval_to_ms(struct timeval *tv)
@@ -83,15 +82,15 @@ static int timeval_to_ms(struct timeval *tv)
 }
 
 void *
-win32_init(void)
+win32_init(struct event_base *base)
 {
 	return (&win32ops);
 }
 
 int
-win32_recalc(void *arg, int max)
+win32_recalc(struct event_base *base, void *arg, int max)
 {
-	return (signal_recalc());
+	return (signal_recalc(base));
 }
 
 int
@@ -111,21 +110,21 @@ win32_insert(struct win32op *wop, struct event *ev)
 }
 
 int
-win32_dispatch(void *arg, struct timeval *tv)
+win32_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
 	int res = 0;
 	struct win32op *wop = arg;
 	struct event *ev;
 	int evres;
 
-	TAILQ_FOREACH(ev, &eventqueue, ev_next) {
+	TAILQ_FOREACH(ev, &base->eventqueue, ev_next) {
 		res = WaitForSingleObject(ev->ev_fd, timeval_to_ms(tv));
 
 		if(res == WAIT_TIMEOUT || res == WAIT_FAILED) {
-			signal_process();
+			signal_process(base);
 			return (0);
 		} else if (signal_caught)
-			signal_process();
+			signal_process(base);
 
 		evres = 0;
 		if(ev->ev_events & EV_READ)
@@ -140,7 +139,7 @@ win32_dispatch(void *arg, struct timeval *tv)
 		}
 	}
 
-	if (signal_recalc() == -1)
+	if (signal_recalc(base) == -1)
 		return (-1);
 
 	return (0);
@@ -161,12 +160,12 @@ static int signal_handler(int sig)
 }
 
 int
-signal_recalc(void)
+signal_recalc(struct event_base *base)
 {
 	struct event *ev;
 
 	/* Reinstall our signal handler. */
-	TAILQ_FOREACH(ev, &signalqueue, ev_signal_next) {
+	TAILQ_FOREACH(ev, &base->signalqueue, ev_signal_next) {
 		if((int)signal(EVENT_SIGNAL(ev), signal_handler) == -1)
 			return (-1);
 	}
@@ -174,12 +173,12 @@ signal_recalc(void)
 }
 
 void
-signal_process(void)
+signal_process(struct event_base *base)
 {
 	struct event *ev;
 	short ncalls;
 
-	TAILQ_FOREACH(ev, &signalqueue, ev_signal_next) {
+	TAILQ_FOREACH(ev, &base->signalqueue, ev_signal_next) {
 		ncalls = evsigcaught[EVENT_SIGNAL(ev)];
 		if (ncalls) {
 			if (!(ev->ev_events & EV_PERSIST))
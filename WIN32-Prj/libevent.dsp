@@ -93,6 +93,10 @@ SOURCE=..\event.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\timewheel.c
+# End Source File
+# Begin Source File
+
 SOURCE="..\WIN32-Code\misc.c"
 # End Source File
 # Begin Source File
@@ -121,6 +125,14 @@ SOURCE=..\event.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\event-internal.h
+# End Source File
+# Begin Source File
+
+SOURCE=..\timewheel.h
+# End Source File
+# Begin Source File
+
 SOURCE="..\WIN32-Code\misc.h"
 # End Source File
 # End Group
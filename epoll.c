@@ -30,7 +30,6 @@
 
 #include <stdint.h>
 #include <sys/types.h>
-#include <sys/resource.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #else
@@ -54,34 +53,50 @@
 #endif
 
 #include "event.h"
+#include "event-internal.h"
 #include "evsignal.h"
 
-extern struct event_list eventqueue;
-
-extern volatile sig_atomic_t evsignal_caught;
-
 /* due to limitations in the epoll interface, we need to keep track of
  * all file descriptors outself.
  */
 struct evepoll {
 	struct event *evread;
 	struct event *evwrite;
+
+	/* The events armed in the kernel, only used for comparison */
+	struct event *kread;
+	struct event *kwrite;
+	int kregistered;	/* fd is in the epoll set, maybe disarmed */
+	int koneshot;		/* registered with EPOLLONESHOT */
+	int changed;		/* fd is on the changelist */
+	int dropped;		/* all interest was deleted since the wait */
 };
 
 struct epollop {
 	struct evepoll *fds;
 	int nfds;
+	int *changes;		/* fds whose interest changed since the wait */
+	int nchanges;
+	int achanges;
 	struct epoll_event *events;
 	int nevents;//数量
+	int nsmall;		/* waits that used less than a quarter */
 	int epfd;
-	sigset_t evsigmask;
-} epollop;
+	int pwait2;		/* the kernel has epoll_pwait2 */
+	int collapse;		/* trust that a deleted fd stays open */
+};
 
-void *epoll_init	(void);
+void *epoll_init	(struct event_base *);
 int epoll_add	(void *, struct event *);
 int epoll_del	(void *, struct event *);
-int epoll_recalc	(void *, int);
-int epoll_dispatch	(void *, struct timeval *);
+int epoll_recalc	(struct event_base *, void *, int);
+int epoll_dispatch	(struct event_base *, void *, struct timeval *);
+void epoll_dealloc	(struct event_base *, void *);
+
+static int epoll_change(struct epollop *, int);
+static int epoll_apply_fd(struct epollop *, int);
+static int epoll_apply_changes(struct epollop *);
+static void epoll_resize_events(struct epollop *, int);
 
 struct eventop epollops = {
 	"epoll",
@@ -89,43 +104,29 @@ struct eventop epollops = {
 	epoll_add,
 	epoll_del,
 	epoll_recalc,
-	epoll_dispatch
+	epoll_dispatch,
+	epoll_dealloc,
+	EV_FEATURE_THREADS|EV_FEATURE_ET,
+	NULL
 };
 
-#define NEVENT	32000
+#define NEVENT	32000		/* size hint for epoll_create */
+
+#define INITIAL_NFILES	32
+#define INITIAL_NEVENT	32
+#define MAX_NEVENT	4096
+#define SHRINK_AFTER	64	/* small waits before halving the events */
 
 void *
-epoll_init(void)
+epoll_init(struct event_base *base)
 {
-	int epfd, nfiles = NEVENT;
-	/*
-	定义放在头文件/usr/include/bits/resource.h中
-	struct rlimit
-	{        
-   		rlim_t rlim_cur;        
-   		rlim_t rlim_max;
-	};
-	结构体中 rlim_cur是要取得或设置的资源软限制的值，rlim_max是硬限制
-	这两个值的设置有一个小的约束：
-	1） 任何进程可以将软限制改为小于或等于硬限制
-	2）任何进程都可以将硬限制降低，但普通用户降低了就无法提高，该值必须等于或大于软限制
-	3） 只有超级用户可以提高硬限制
-	一个无限的限制由常量RLIM_INFINITY指定（The value RLIM_INFINITY denotes no limit on a resource ）
-	*/
-	struct rlimit rl;
+	int epfd;
+	struct epollop *epollop;
 
 	/* Disable epollueue when this environment variable is set */
 	if (getenv("EVENT_NOEPOLL"))
 		return (NULL);
 
-	memset(&epollop, 0, sizeof(epollop));
-	/*
-		RLIMIT_NOFILE,一个进程能打开的最大文件数。内核默认是1024。最大值也是1024。
-	*/
-	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
-	    rl.rlim_cur != RLIM_INFINITY)
-		nfiles = rl.rlim_cur;
-
 	/* Initalize the kernel queue */
 	/* 创建上限数量的文件句柄
 	创建一个epoll的句柄，size用来告诉内核这个监听的数目一共有多大。
@@ -138,36 +139,64 @@ epoll_init(void)
 	epoll专用的文件描述符
 	*/
 
-	if ((epfd = epoll_create(nfiles)) == -1) {
+	if ((epfd = epoll_create(NEVENT)) == -1) {
 		log_error("epoll_create");
 		return (NULL);
 	}
 
-	epollop.epfd = epfd;
+	if (!(epollop = calloc(1, sizeof(struct epollop)))) {
+		close(epfd);
+		return (NULL);
+	}
+
+	epollop->epfd = epfd;
+
+	/* Lets a delete followed by an add of the same events cost nothing */
+	if (getenv("EVENT_EPOLL_COLLAPSE"))
+		epollop->collapse = 1;
+
+#if defined(HAVE_EPOLL_PWAIT) && defined(HAVE_EPOLL_PWAIT2)
+	/* Older kernels only take the timeout in milliseconds */
+	{
+		struct epoll_event ev;
+		struct timespec ts = { 0, 0 };
+
+		if (epoll_pwait2(epfd, &ev, 1, &ts, NULL) != -1 ||
+		    errno != ENOSYS)
+			epollop->pwait2 = 1;
+	}
+#endif
 
-	/* Initalize fields */
-	epollop.events = malloc(nfiles * sizeof(struct epoll_event));
-	if (epollop.events == NULL)
+	/*
+	 * Initalize fields.  Both arrays start small: the fd table grows
+	 * with the largest fd added, the event array with the number of
+	 * fds reported by one epoll_wait.
+	 */
+	epollop->events = malloc(INITIAL_NEVENT * sizeof(struct epoll_event));
+	if (epollop->events == NULL) {
+		free(epollop);
+		close(epfd);
 		return (NULL);
-	epollop.nevents = nfiles;//数量
+	}
+	epollop->nevents = INITIAL_NEVENT;//数量
 
-	epollop.fds = calloc(nfiles, sizeof(struct evepoll));
-	if (epollop.fds == NULL) {
-		free(epollop.events);
+	epollop->fds = calloc(INITIAL_NFILES, sizeof(struct evepoll));
+	if (epollop->fds == NULL) {
+		free(epollop->events);
+		free(epollop);
+		close(epfd);
 		return (NULL);
 	}
-	epollop.nfds = nfiles;
+	epollop->nfds = INITIAL_NFILES;
 
-	evsignal_init(&epollop.evsigmask);
+	evsignal_init(base);
 
-	return (&epollop);
+	return (epollop);
 }
 
-int
-epoll_recalc(void *arg, int max)
+static int
+epoll_grow(struct epollop *epollop, int max)
 {
-	struct epollop *epollop = arg;
-
 	if (max > epollop->nfds) {
 		struct evepoll *fds;
 		int nfds;
@@ -187,24 +216,85 @@ epoll_recalc(void *arg, int max)
 		epollop->nfds = nfds;
 	}
 
-	return (evsignal_recalc(&epollop->evsigmask));
+	return (0);
+}
+
+/* Failing to resize is harmless, we just keep the current array */
+static void
+epoll_resize_events(struct epollop *epollop, int nevents)
+{
+	struct epoll_event *events;
+
+	events = realloc(epollop->events, nevents * sizeof(struct epoll_event));
+	if (events == NULL) {
+		log_error("realloc");
+		return;
+	}
+	epollop->events = events;
+	epollop->nevents = nevents;
+	epollop->nsmall = 0;
+}
+
+int
+epoll_recalc(struct event_base *base, void *arg, int max)
+{
+	struct epollop *epollop = arg;
+
+	if (epoll_grow(epollop, max) == -1)
+		return (-1);
+
+	return (evsignal_recalc(base));
 }
 
 int
-epoll_dispatch(void *arg, struct timeval *tv)
+epoll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
 	struct epollop *epollop = arg;
 	struct epoll_event *events = epollop->events;
 	struct evepoll *evep;
 	int i, res, timeout;
+#ifdef HAVE_EPOLL_PWAIT
+	const sigset_t *sigmask = evsignal_waitmask(base);
+#ifdef HAVE_EPOLL_PWAIT2
+	struct timespec ts;
 
-	if (evsignal_deliver(&epollop->evsigmask) == -1)
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+#endif
+#else
+
+	if (evsignal_deliver(base) == -1)
 		return (-1);
+#endif
+
+	/* Rounded up, so that a short timeout does not spin on zero */
+	timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
 
-	timeout = tv->tv_sec * 1000 + tv->tv_usec / 1000;
+	/* Events of fds the kernel refused are active now */
+	if (epoll_apply_changes(epollop) > 0) {
+		timeout = 0;
+#if defined(HAVE_EPOLL_PWAIT) && defined(HAVE_EPOLL_PWAIT2)
+		ts.tv_sec = ts.tv_nsec = 0;
+#endif
+	}
+
+	EVBASE_RELEASE_LOCK(base);
+#ifdef HAVE_EPOLL_PWAIT
+	/* Unblocks the signals only for the duration of the wait */
+#ifdef HAVE_EPOLL_PWAIT2
+	if (epollop->pwait2)
+		res = epoll_pwait2(epollop->epfd, events, epollop->nevents,
+		    &ts, sigmask);
+	else
+#endif
+	res = epoll_pwait(epollop->epfd, events, epollop->nevents, timeout,
+	    sigmask);
+#else
 	res = epoll_wait(epollop->epfd, events, epollop->nevents, timeout);
+#endif
+	EVBASE_ACQUIRE_LOCK(base);
 
-	if (evsignal_recalc(&epollop->evsigmask) == -1)
+	if (evsignal_recalc(base) == -1)
 		return (-1);
 
 	if (res == -1) {
@@ -213,10 +303,10 @@ epoll_dispatch(void *arg, struct timeval *tv)
 			return (-1);
 		}
 
-		evsignal_process();
+		evsignal_process(base);
 		return (0);
-	} else if (evsignal_caught)
-		evsignal_process();
+	} else if (base->sig.evsignal_caught)
+		evsignal_process(base);
 
 	LOG_DBG((LOG_MISC, 80, "%s: epoll_wait reports %d", __func__, res));
 
@@ -225,7 +315,10 @@ epoll_dispatch(void *arg, struct timeval *tv)
 		int what = events[i].events;
 		struct event *evread = NULL, *evwrite = NULL;
 
-		evep = (struct evepoll *)events[i].data.ptr;
+		/* fds may have been reallocated by another thread */
+		if (events[i].data.fd >= epollop->nfds)
+			continue;
+		evep = &epollop->fds[events[i].data.fd];
    
                 if (what & EPOLLHUP)
                         what |= EPOLLIN | EPOLLOUT;
@@ -245,6 +338,13 @@ epoll_dispatch(void *arg, struct timeval *tv)
 		if (!which)
 			continue;
 
+		/* The kernel disarmed the fd, including any unreported side */
+		if (evep->koneshot) {
+			evep->kread = evep->kwrite = NULL;
+			if (epoll_change(epollop, events[i].data.fd) == -1)
+				return (-1);
+		}
+
 		if (evread != NULL && !(evread->ev_events & EV_PERSIST))
 			event_del(evread);
 		if (evwrite != NULL && evwrite != evread &&
@@ -257,51 +357,215 @@ epoll_dispatch(void *arg, struct timeval *tv)
 			event_active(evwrite, EV_WRITE, 1);
 	}
 
+	/* Size the event array after the number of fds that are ready */
+	if (res == epollop->nevents && epollop->nevents < MAX_NEVENT) {
+		epoll_resize_events(epollop, epollop->nevents * 2);
+	} else if (res < epollop->nevents / 4 &&
+	    epollop->nevents > INITIAL_NEVENT) {
+		if (++epollop->nsmall == SHRINK_AFTER)
+			epoll_resize_events(epollop, epollop->nevents / 2);
+	} else
+		epollop->nsmall = 0;
+
+	return (0);
+}
+
+
+/*
+ * Remembers that the interest in fd changed.  The kernel is only told
+ * right before we wait, so that any number of changes to an fd that is
+ * already registered cost at most one system call.
+ */
+static int
+epoll_change(struct epollop *epollop, int fd)
+{
+	struct evepoll *evep = &epollop->fds[fd];
+
+	if (evep->changed)
+		return (0);
+
+	if (epollop->nchanges == epollop->achanges) {
+		int *changes, n = epollop->achanges ? epollop->achanges * 2 : 64;
+
+		if ((changes = realloc(epollop->changes, n * sizeof(int))) == NULL) {
+			log_error("realloc");
+			return (-1);
+		}
+		epollop->changes = changes;
+		epollop->achanges = n;
+	}
+
+	epollop->changes[epollop->nchanges++] = fd;
+	evep->changed = 1;
+
+	return (0);
+}
+
+/* Makes the kernel state of fd match the events interested in it */
+static int
+epoll_apply_fd(struct epollop *epollop, int fd)
+{
+	struct evepoll *evep = &epollop->fds[fd];
+	struct epoll_event epev;
+	int op, events;
+
+	/*
+	 * Once nothing was interested in the fd it may have been
+	 * closed, which makes the kernel forget it, and reused.  So
+	 * the registration has to be redone even if it looks equal.
+	 */
+	if (!evep->dropped &&
+	    evep->evread == evep->kread && evep->evwrite == evep->kwrite)
+		return (0);
+
+	events = 0;
+	if (evep->evread != NULL)
+		events |= EPOLLIN;
+	if (evep->evwrite != NULL)
+		events |= EPOLLOUT;
+	if ((evep->evread != NULL && (evep->evread->ev_events & EV_ET)) ||
+	    (evep->evwrite != NULL && (evep->evwrite->ev_events & EV_ET)))
+		events |= EPOLLET;
+
+	/*
+	 * If no event on the fd is persistent, the kernel disarms
+	 * the fd when it reports it.  That saves deleting it after
+	 * the callbacks and rearming it is a single MOD.
+	 */
+	if ((evep->evread == NULL ||
+		!(evep->evread->ev_events & EV_PERSIST)) &&
+	    (evep->evwrite == NULL ||
+		!(evep->evwrite->ev_events & EV_PERSIST)))
+		events |= EPOLLONESHOT;
+
+	if (!(events & (EPOLLIN|EPOLLOUT))) {
+		/* A fired oneshot fd reports nothing until rearmed */
+		if (evep->kread == NULL && evep->kwrite == NULL) {
+			evep->dropped = 0;
+			return (0);
+		}
+		op = EPOLL_CTL_DEL;
+	} else if (!evep->kregistered)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	epev.data.fd = fd;
+	epev.events = events;
+	if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1) {
+		/* The kernel forgets closed fds on its own */
+		if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			op = EPOLL_CTL_ADD;
+		else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			op = EPOLL_CTL_MOD;
+		else if (op == EPOLL_CTL_DEL &&
+		    (errno == ENOENT || errno == EBADF))
+			op = -1;
+		else
+			return (-1);
+
+		if (op >= 0 && epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
+			return (-1);
+	}
+
+	evep->kread = evep->evread;
+	evep->kwrite = evep->evwrite;
+	evep->kregistered = (events & (EPOLLIN|EPOLLOUT)) != 0;
+	evep->koneshot = (events & EPOLLONESHOT) != 0;
+	evep->dropped = 0;
+
 	return (0);
 }
 
+/*
+ * Applies the net change of every fd on the changelist.  Returns the
+ * number of fds the kernel refused, whose events are made active so that
+ * their callbacks run into the error when they do their I/O.
+ */
+static int
+epoll_apply_changes(struct epollop *epollop)
+{
+	struct evepoll *evep;
+	struct event *evread, *evwrite;
+	int i, fd, failed = 0;
+
+	/* Deleting the events of a refused fd may append to the list */
+	for (i = 0; i < epollop->nchanges; i++) {
+		fd = epollop->changes[i];
+		evep = &epollop->fds[fd];
+		evep->changed = 0;
+
+		if (epoll_apply_fd(epollop, fd) == 0)
+			continue;
+		log_error("epoll_ctl");
+		failed++;
+
+		evread = evep->evread;
+		evwrite = evep->evwrite;
+		if (evread != NULL && !(evread->ev_events & EV_PERSIST))
+			event_del(evread);
+		if (evwrite != NULL && evwrite != evread &&
+		    !(evwrite->ev_events & EV_PERSIST))
+			event_del(evwrite);
+
+		if (evread != NULL)
+			event_active(evread, EV_READ, 1);
+		if (evwrite != NULL)
+			event_active(evwrite, EV_WRITE, 1);
+	}
+
+	epollop->nchanges = 0;
+
+	return (failed);
+}
 
 int
 epoll_add(void *arg, struct event *ev)
 {
-	/*
-	名字为什么取的那么像。。
-	*/
 	struct epollop *epollop = arg;
-	struct epoll_event epev;
 	struct evepoll *evep;
-	int fd, op, events;
+	int fd;
 
 	if (ev->ev_events & EV_SIGNAL)
-		return (evsignal_add(&epollop->evsigmask, ev));
+		return (evsignal_add(ev));
 
 	fd = ev->ev_fd;
 	if (fd >= epollop->nfds) {
 		/* Extent the file descriptor array as necessary */
-		if (epoll_recalc(epollop, fd) == -1)
+		if (epoll_grow(epollop, fd + 1) == -1)
 			return (-1);
 	}
 	evep = &epollop->fds[fd];//自定义的用于存储读事件和写事件的结构
-	op = EPOLL_CTL_ADD;//注册新的fd到epfd中；
-	events = 0;
-	if (evep->evread != NULL) {
-		events |= EPOLLIN;//有可读数据
-		op = EPOLL_CTL_MOD;//修改已经注册的fd的监听事件；
-	}
-	if (evep->evwrite != NULL) {
-		events |= EPOLLOUT;//可以写数据
-		op = EPOLL_CTL_MOD;
-	}
 
-	if (ev->ev_events & EV_READ)
-		events |= EPOLLIN;
-	if (ev->ev_events & EV_WRITE)
-		events |= EPOLLOUT;
+	/* The kernel has only one trigger mode per fd */
+	if ((evep->evread != NULL && evep->evread != ev &&
+		((evep->evread->ev_events ^ ev->ev_events) & EV_ET)) ||
+	    (evep->evwrite != NULL && evep->evwrite != ev &&
+		((evep->evwrite->ev_events ^ ev->ev_events) & EV_ET)))
+		return (-1);
 
-	epev.data.ptr = evep;//事件标志
-	epev.events = events;//用户自定义数据，把libevent的event传进，作为自定义参数
-	if (epoll_ctl(epollop->epfd, op, ev->ev_fd, &epev) == -1)
+	/*
+	 * An fd the kernel does not know yet is registered right away, so
+	 * that adding an fd epoll does not support, e.g. a regular file,
+	 * still fails.  Later changes go through the changelist.
+	 */
+	if (!evep->kregistered || evep->dropped) {
+		struct event *evread = evep->evread, *evwrite = evep->evwrite;
+
+		if (ev->ev_events & EV_READ)
+			evep->evread = ev;
+		if (ev->ev_events & EV_WRITE)
+			evep->evwrite = ev;
+		if (epoll_apply_fd(epollop, fd) == -1) {
+			evep->evread = evread;
+			evep->evwrite = evwrite;
 			return (-1);
+		}
+		return (0);
+	}
+
+	if (epoll_change(epollop, fd) == -1)
+		return (-1);
 
 	/* Update events responsible */
 	if (ev->ev_events & EV_READ)
@@ -316,49 +580,49 @@ int
 epoll_del(void *arg, struct event *ev)
 {
 	struct epollop *epollop = arg;
-	struct epoll_event epev;
 	struct evepoll *evep;
-	int fd, events, op;
-	int needwritedelete = 1, needreaddelete = 1;
+	int fd;
 
 	if (ev->ev_events & EV_SIGNAL)
-		return (evsignal_del(&epollop->evsigmask, ev));
+		return (evsignal_del(ev));
 
 	fd = ev->ev_fd;
 	if (fd >= epollop->nfds)
 		return (0);
 	evep = &epollop->fds[fd];
 
-	op = EPOLL_CTL_DEL;
-	events = 0;
-
-	if (ev->ev_events & EV_READ)
-		events |= EPOLLIN;
-	if (ev->ev_events & EV_WRITE)
-		events |= EPOLLOUT;
-
-	if ((events & (EPOLLIN|EPOLLOUT)) != (EPOLLIN|EPOLLOUT)) {
-		if ((events & EPOLLIN) && evep->evwrite != NULL) {
-			needwritedelete = 0;
-			events = EPOLLOUT;
-			op = EPOLL_CTL_MOD;
-		} else if ((events & EPOLLOUT) && evep->evread != NULL) {
-			needreaddelete = 0;
-			events = EPOLLIN;
-			op = EPOLL_CTL_MOD;
-		}
-	}
-
-	epev.events = events;
-	epev.data.ptr = evep;
-
-	if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
+	if (epoll_change(epollop, fd) == -1)
 		return (-1);
 
-	if (needreaddelete)
+	if (ev->ev_events & EV_READ)
 		evep->evread = NULL;
-	if (needwritedelete)
+	if (ev->ev_events & EV_WRITE)
 		evep->evwrite = NULL;
+	/*
+	 * Unless the fd is trusted to stay open, it has to be registered
+	 * again even if the same events are added back before the wait.
+	 */
+	if (evep->evread == NULL && evep->evwrite == NULL &&
+	    !epollop->collapse)
+		evep->dropped = 1;
 
 	return (0);
 }
+
+void
+epoll_dealloc(struct event_base *base, void *arg)
+{
+	struct epollop *epollop = arg;
+
+	evsignal_dealloc(base);
+	if (epollop->fds)
+		free(epollop->fds);
+	if (epollop->events)
+		free(epollop->events);
+	if (epollop->changes)
+		free(epollop->changes);
+	if (epollop->epfd >= 0)
+		close(epollop->epfd);
+
+	free(epollop);
+}
@@ -34,9 +34,11 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#include <sys/queue.h>
 
 #include <err.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +47,7 @@
 #endif
 
 #include "event.h"
+#include "event-internal.h"
 
 static int
 bufferevent_add(struct event *ev, int timeout)
@@ -90,13 +93,35 @@ bufferevent_read_pressure_cb(struct evbuffer *buf, size_t old, size_t now,
 	}
 }
 
+/* Runs the read callback once new input meets the water marks */
+static void
+bufferevent_read_done(struct bufferevent *bufev)
+{
+	size_t len;
+
+	/* See if this callbacks meets the water marks */
+	len = EVBUFFER_LENGTH(bufev->input);
+	if (bufev->wm_read.low != 0 && len < bufev->wm_read.low)
+		return;
+	if (bufev->wm_read.high != 0 && len > bufev->wm_read.high) {
+		struct evbuffer *buf = bufev->input;
+		event_del(&bufev->ev_read);
+
+		/* Now schedule a callback for us */
+		evbuffer_setcb(buf, bufferevent_read_pressure_cb, bufev);
+		return;
+	}
+
+	/* Invoke the user callback - must always be called last */
+	(*bufev->readcb)(bufev, bufev->cbarg);
+}
+
 static void
 bufferevent_readcb(int fd, short event, void *arg)
 {
 	struct bufferevent *bufev = arg;
 	int res = 0;
 	short what = EVBUFFER_READ;
-	size_t len;
 
 	if (event == EV_TIMEOUT) {
 		what |= EVBUFFER_TIMEOUT;
@@ -118,22 +143,7 @@ bufferevent_readcb(int fd, short event, void *arg)
 		goto error;
 
 	bufferevent_add(&bufev->ev_read, bufev->timeout_read);
-
-	/* See if this callbacks meets the water marks */
-	len = EVBUFFER_LENGTH(bufev->input);
-	if (bufev->wm_read.low != 0 && len < bufev->wm_read.low)
-		return;
-	if (bufev->wm_read.high != 0 && len > bufev->wm_read.high) {
-		struct evbuffer *buf = bufev->input;
-		event_del(&bufev->ev_read);
-
-		/* Now schedule a callback for us */
-		evbuffer_setcb(buf, bufferevent_read_pressure_cb, bufev);
-		return;
-	}
-
-	/* Invoke the user callback - must always be called last */
-	(*bufev->readcb)(bufev, bufev->cbarg);
+	bufferevent_read_done(bufev);
 	return;
 
  reschedule:
@@ -192,6 +202,102 @@ bufferevent_writecb(int fd, short event, void *arg)
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
+/*
+ * In completion mode the backend has already moved the data when these
+ * callbacks run.  Input is appended to the input buffer directly, output
+ * is sent from a private buffer that the output buffer is swapped into
+ * whenever the previous send finished.
+ */
+
+static int
+bufferevent_add_write(struct bufferevent *bufev)
+{
+	struct evbuffer *sending = bufev->ev_write.ev_buffer;
+
+	if (sending != NULL && EVBUFFER_LENGTH(sending) == 0 &&
+	    EVBUFFER_LENGTH(bufev->output) != 0 &&
+	    evbuffer_add_buffer(sending, bufev->output) == -1)
+		return (-1);
+
+	return (bufferevent_add(&bufev->ev_write, bufev->timeout_write));
+}
+
+static void
+bufferevent_readcb_completion(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct event *ev = &bufev->ev_read;
+	short what = EVBUFFER_READ;
+
+	if (event == EV_TIMEOUT) {
+		what |= EVBUFFER_TIMEOUT;
+		goto error;
+	}
+
+	if (ev->ev_iobytes == 0) {
+		/* The error stays, enabling again reports it again */
+		event_del(ev);
+		if (ev->ev_ioerror == -1)
+			what |= EVBUFFER_EOF;
+		else {
+			errno = ev->ev_ioerror;
+			what |= EVBUFFER_ERROR;
+		}
+		goto error;
+	}
+
+	/* Deliver the data first and the error on the next round */
+	ev->ev_iobytes = 0;
+	if (ev->ev_ioerror)
+		event_active(ev, EV_READ, 1);
+
+	/* Restarts the timeout */
+	bufferevent_add(ev, bufev->timeout_read);
+	bufferevent_read_done(bufev);
+	return;
+
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
+static void
+bufferevent_writecb_completion(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct event *ev = &bufev->ev_write;
+	short what = EVBUFFER_WRITE;
+	size_t len;
+
+	if (event == EV_TIMEOUT) {
+		what |= EVBUFFER_TIMEOUT;
+		goto error;
+	}
+
+	if (ev->ev_ioerror) {
+		errno = ev->ev_ioerror;
+		ev->ev_ioerror = 0;
+		what |= EVBUFFER_ERROR;
+		goto error;
+	}
+	ev->ev_iobytes = 0;
+
+	len = EVBUFFER_LENGTH(bufev->output) + EVBUFFER_LENGTH(ev->ev_buffer);
+	if (len != 0)
+		bufferevent_add_write(bufev);
+
+	/*
+	 * Invoke the user callback if our buffer is drained or below the
+	 * low watermark.
+	 */
+	if (len <= bufev->wm_write.low)
+		(*bufev->writecb)(bufev, bufev->cbarg);
+
+	return;
+
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
 /*
  * Create a new buffered event object.
  *
@@ -242,10 +348,70 @@ bufferevent_free(struct bufferevent *bufev)
 
 	evbuffer_free(bufev->input);
 	evbuffer_free(bufev->output);
+	if (bufev->ev_write.ev_buffer != NULL)
+		evbuffer_free(bufev->ev_write.ev_buffer);
 
 	free(bufev);
 }
 
+/*
+ * Moves both events of the buffered event onto another event base.
+ * Only possible before the bufferevent has been enabled.
+ */
+
+int
+bufferevent_base_set(struct event_base *base, struct bufferevent *bufev)
+{
+	int res;
+
+	res = event_base_set(base, &bufev->ev_read);
+	if (res == -1)
+		return (res);
+
+	res = event_base_set(base, &bufev->ev_write);
+	return (res);
+}
+
+/*
+ * Lets the backend read into the input buffer and write from the output
+ * buffer, instead of reporting readiness.  Must be called after
+ * bufferevent_base_set and before the bufferevent has been enabled.
+ * Returns -1 if the backend of the event base does not support it.
+ */
+
+int
+bufferevent_use_completion(struct bufferevent *bufev)
+{
+	struct event_base *base = bufev->ev_read.ev_base;
+	struct evbuffer *sending;
+	int fd = bufev->ev_read.ev_fd;
+
+	if (bufev->ev_read.ev_events & EV_COMPLETION)
+		return (0);
+
+	if (base == NULL || base->evsel->completion == NULL ||
+	    base->evsel->completion(base->evbase) == -1)
+		return (-1);
+
+	if ((sending = evbuffer_new()) == NULL)
+		return (-1);
+
+	event_del(&bufev->ev_read);
+	event_del(&bufev->ev_write);
+
+	event_set(&bufev->ev_read, fd, EV_READ|EV_PERSIST|EV_COMPLETION,
+	    bufferevent_readcb_completion, bufev);
+	event_base_set(base, &bufev->ev_read);
+	bufev->ev_read.ev_buffer = bufev->input;
+
+	event_set(&bufev->ev_write, fd, EV_WRITE|EV_COMPLETION,
+	    bufferevent_writecb_completion, bufev);
+	event_base_set(base, &bufev->ev_write);
+	bufev->ev_write.ev_buffer = sending;
+
+	return (0);
+}
+
 /*
  * 添加buffer成功，我们就安排一次bufferevent事件。写成功事件
  * Returns 0 on success;
@@ -264,7 +430,7 @@ bufferevent_write(struct bufferevent *bufev, void *data, size_t size)
 
 	/* If everything is okay, we need to schedule a write */
 	if (size > 0 && (bufev->enabled & EV_WRITE))
-		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+		bufferevent_add_write(bufev);
 
 	return (res);
 }
@@ -309,7 +475,7 @@ bufferevent_enable(struct bufferevent *bufev, short event)
 			return (-1);
 	}
 	if (event & EV_WRITE) {
-		if (bufferevent_add(&bufev->ev_write, bufev->timeout_write) == -1)
+		if (bufferevent_add_write(bufev) == -1)
 			return (-1);
 	}
 
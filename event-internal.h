@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVENT_INTERNAL_H_
+#define _EVENT_INTERNAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "min_heap.h"
+#include "timewheel.h"
+#ifndef WIN32
+#include "evsignal.h"
+#endif
+
+/*
+ * Events that share one duration expire in the order they were added, so
+ * they are kept in a plain list.  Only the head is scheduled with the
+ * heap or wheel, through timeout_event.
+ */
+struct common_timeout_list {
+	struct event_list events;
+	struct timeval duration;	/* encoded handle given to the user */
+	struct event timeout_event;
+	struct event_base *base;
+};
+
+struct event_once;
+
+/* A callback handed to the loop by event_base_post */
+struct event_post {
+	struct event_post *next;
+	void (*cb)(void *);
+	void *arg;
+};
+
+/*
+ * All state of one event loop.  Nothing in here is shared between
+ * bases, so independent loops can run in different threads.
+ */
+struct event_base {
+	const struct eventop *evsel;
+	void *evbase;
+	int event_count;		/* counts number of total events */
+	int event_count_active;		/* counts number of active events */
+
+	int event_gotterm;		/* Set to terminate loop */
+
+	/* active event management, one queue per priority */
+	struct event_list *activequeues;
+	int nactivequeues;
+
+	struct event_list signalqueue;
+	struct event_list eventqueue;
+	struct timeval event_tv;
+
+	/* clock reading shared by one loop iteration, unset outside it */
+	struct timeval tv_cache;
+	struct timeval tv_cache_wall;	/* its time of day, read lazily */
+	int no_cache_time;
+
+	struct min_heap timeheap;
+	struct timewheel *timewheel;	/* replaces the heap if set */
+	struct timeval timer_slack;	/* wakeups are rounded up to it */
+
+	/* set up by event_base_set_busy_poll, in microseconds */
+	long busy_poll_max;
+	long busy_poll_cur;		/* adapted to how soon events arrive */
+	unsigned long busy_poll_hits;	/* spins that found an event */
+	unsigned long busy_poll_sleeps;	/* spins that ended in a wait */
+
+	struct common_timeout_list **common_timeout_queues;
+	int n_common_timeouts;
+	int n_common_timeouts_allocated;
+
+	/* set up by event_base_enable_threads */
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t *th_lock;
+	pthread_t th_owner;		/* thread running the loop */
+#endif
+	int th_loop_running;
+	int th_notify_fd[2];		/* both ends are equal for eventfd */
+	int th_notify_pending;		/* a wakeup is already on its way */
+	unsigned long th_wakeups;	/* writes to th_notify_fd */
+	struct event th_notify;
+
+	/* finished event_once records ready for reuse */
+	struct event_once *once_cache;
+	int once_cached;
+
+	/* lock-free stack of posted callbacks, newest first */
+	struct event_post * volatile post_head;
+
+#ifndef WIN32
+	struct evsignal_info sig;
+#endif
+};
+
+/*
+ * With threads enabled, the loop holds the base lock except while the
+ * backend waits for events; the lock is recursive so that callbacks may
+ * call event_add and friends.
+ */
+#ifdef HAVE_LIBPTHREAD
+#define EVBASE_ACQUIRE_LOCK(base) do {				\
+	if ((base)->th_lock != NULL)				\
+		pthread_mutex_lock((base)->th_lock);		\
+} while (0)
+#define EVBASE_RELEASE_LOCK(base) do {				\
+	if ((base)->th_lock != NULL)				\
+		pthread_mutex_unlock((base)->th_lock);		\
+} while (0)
+#else
+#define EVBASE_ACQUIRE_LOCK(base)
+#define EVBASE_RELEASE_LOCK(base)
+#endif
+
+/* Time of the loop; monotonic if the system supports it */
+int event_gettime(struct timeval *);
+
+/* Activates an expired timeout; called with the base lock held */
+void event_timeout_expire(struct event *, struct timeval *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _EVENT_INTERNAL_H_ */
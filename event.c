@@ -35,7 +35,6 @@
 #include "misc.h"
 #endif
 #include <sys/types.h>
-#include <sys/tree.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #else 
@@ -49,8 +48,14 @@
 #endif
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #ifdef USE_LOG
 #include "log.h"
@@ -60,6 +65,7 @@
 #endif
 
 #include "event.h"
+#include "event-internal.h"
 
 #ifdef HAVE_SELECT
 extern const struct eventop selectops;
@@ -73,6 +79,9 @@ extern const struct eventop rtsigops;
 #ifdef HAVE_EPOLL
 extern const struct eventop epollops;
 #endif
+#ifdef HAVE_IO_URING
+extern const struct eventop iouringops;
+#endif
 #ifdef HAVE_WORKING_KQUEUE
 extern const struct eventop kqops;
 #endif
@@ -88,6 +97,9 @@ const struct eventop *eventops[] = {
 #ifdef HAVE_EPOLL
 	&epollops,
 #endif
+#ifdef HAVE_IO_URING
+	&iouringops,
+#endif
 #ifdef HAVE_RTSIG
 	&rtsigops,
 #endif
@@ -105,107 +117,613 @@ const struct eventop *eventops[] = {
 
 /* Global state */
 
-const struct eventop *evsel;
-void *evbase;
-static int event_count;//计数现在队列有多少数据
+struct event_base *current_base = NULL;
+
+/*
+ * A common timeout handle is a timeval whose tv_usec carries a magic
+ * number and the index of its list above the microseconds.  Deadlines of
+ * events on such a list are encoded the same way, so we can tell which
+ * list an event is on without any further state.
+ */
+#define COMMON_TIMEOUT_MICROSECONDS_MASK	0x000fffff
+#define COMMON_TIMEOUT_IDX_MASK			0x0ff00000
+#define COMMON_TIMEOUT_IDX_SHIFT		20
+#define COMMON_TIMEOUT_MASK			0xf0000000
+#define COMMON_TIMEOUT_MAGIC			0x50000000
+#define MAX_COMMON_TIMEOUTS			256
+
+#define COMMON_TIMEOUT_IDX(tv) \
+	(((tv)->tv_usec & COMMON_TIMEOUT_IDX_MASK) >> COMMON_TIMEOUT_IDX_SHIFT)
+
+/* Set if CLOCK_MONOTONIC works, then the loop ignores wall clock steps */
+static int use_monotonic;
 
 /* Handle signals - This is a deprecated interface */
 int (*event_sigcb)(void);	/* Signal callback when gotsig is set */
 int event_gotsig;		/* Set in signal handler */
-int event_gotterm;		/* Set to terminate loop */
 
 /* Prototypes */
-void		event_queue_insert(struct event *, int);
-void		event_queue_remove(struct event *, int);
-int		event_haveevents(void);
+static void	event_queue_insert(struct event_base *, struct event *, int);
+static void	event_queue_remove(struct event_base *, struct event *, int);
+static int	event_haveevents(struct event_base *);
+static int	event_add_internal(struct event *, struct timeval *);
+static int	event_del_internal(struct event *);
+static void	event_active_internal(struct event *, int, short);
+static void	evthread_notify(struct event_base *);
+static int	event_process_posted(struct event_base *);
+static void	event_once_flush(struct event_base *);
+
+static void	event_process_active(struct event_base *);
+
+static int	is_common_timeout(struct timeval *, struct event_base *);
+static void	common_timeout_schedule(struct common_timeout_list *,
+		    struct timeval *, struct event *);
+static void	common_timeout_insert(struct common_timeout_list *,
+		    struct event *);
+
+static int	timeout_next(struct event_base *, struct timeval *);
+static int	event_dispatch_busy_poll(struct event_base *, struct timeval *);
+static void	timeout_correct(struct event_base *, struct timeval *);
+static void	timeout_process(struct event_base *);
+
+struct event_base *
+event_init(void)
+{
+	struct event_base *base = event_base_new();
 
-static void	event_process_active(void);
+	if (base != NULL)
+		current_base = base;
 
-static RB_HEAD(event_tree, event) timetree;
-/*
-当前的活动队列。这个是队头。。。
-*/
-static struct event_list activequeue;//活动队列
-struct event_list signalqueue;
-struct event_list eventqueue;
+	event_sigcb = NULL;
+	event_gotsig = 0;
+
+	return (base);
+}
+
+static void
+detect_monotonic(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec	ts;
 
-static struct timeval event_tv;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		use_monotonic = 1;
+#endif
+}
+
+int
+event_gettime(struct timeval *tp)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	if (use_monotonic) {
+		struct timespec	ts;
+
+		if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+			return (-1);
+
+		tp->tv_sec = ts.tv_sec;
+		tp->tv_usec = ts.tv_nsec / 1000;
+		return (0);
+	}
+#endif
 
+	return (gettimeofday(tp, NULL));
+}
+
+/* Returns the time cached by the loop, or reads the clock */
 static int
-compare(struct event *a, struct event *b)
+gettime(struct event_base *base, struct timeval *tp)
 {
-	if (timercmp(&a->ev_timeout, &b->ev_timeout, <))
-		return (-1);
-	else if (timercmp(&a->ev_timeout, &b->ev_timeout, >))
-		return (1);
-	if (a < b)
+	if (timerisset(&base->tv_cache)) {
+		*tp = base->tv_cache;
+		return (0);
+	}
+
+	return (event_gettime(tp));
+}
+
+static void
+update_time_cache(struct event_base *base)
+{
+	timerclear(&base->tv_cache);
+	timerclear(&base->tv_cache_wall);
+	if (!base->no_cache_time)
+		event_gettime(&base->tv_cache);
+}
+
+static void
+clear_time_cache(struct event_base *base)
+{
+	timerclear(&base->tv_cache);
+	timerclear(&base->tv_cache_wall);
+}
+
+/*
+ * Returns the time of day at which the loop last looked at the clock;
+ * cheaper than gettimeofday() when called from many callbacks.
+ */
+int
+event_base_gettimeofday_cached(struct event_base *base, struct timeval *tv)
+{
+	if (!timerisset(&base->tv_cache))
+		return (gettimeofday(tv, NULL));
+
+	if (!use_monotonic) {
+		*tv = base->tv_cache;
+		return (0);
+	}
+
+	/* Read the wall clock once per iteration */
+	if (!timerisset(&base->tv_cache_wall) &&
+	    gettimeofday(&base->tv_cache_wall, NULL) == -1)
 		return (-1);
-	else if (a > b)
-		return (1);
+	*tv = base->tv_cache_wall;
 	return (0);
 }
 
-RB_PROTOTYPE(event_tree, event, ev_timeout_node, compare);
+/* Makes the loop read the clock every time it needs the time */
+void
+event_base_set_cache_time(struct event_base *base, int enable)
+{
+	base->no_cache_time = !enable;
+	clear_time_cache(base);
+}
+
+/* Drains the wakeups of other threads; they only need the loop to run */
+static void
+evthread_notify_cb(int fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	char buf[64];
+
+	base->th_notify_pending = 0;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	/* A post after our last drain may have written what we just read */
+	event_process_posted(base);
+}
+
+/*
+ * Wakes up the loop if it is waiting in another thread.  Many changes
+ * before the loop gets to run cost a single write.
+ */
+static void
+evthread_notify(struct event_base *base)
+{
+#ifdef HAVE_LIBPTHREAD
+	if (base->th_lock == NULL || !base->th_loop_running ||
+	    base->th_notify_pending ||
+	    pthread_equal(base->th_owner, pthread_self()))
+		return;
+
+	base->th_notify_pending = 1;
+	base->th_wakeups++;
+#ifdef HAVE_EVENTFD
+	{
+		u_int64_t one = 1;
+		write(base->th_notify_fd[1], &one, sizeof(one));
+	}
+#else
+	write(base->th_notify_fd[1], "", 1);
+#endif
+#endif
+}
 
-RB_GENERATE(event_tree, event, ev_timeout_node, compare);
+/*
+ * Makes event_add, event_del and event_active safe to call from other
+ * threads; they wake the loop so that the change takes effect at once.
+ */
+int
+event_base_enable_threads(struct event_base *base)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutexattr_t attr;
+	int i;
 
+	if (base->th_lock != NULL)
+		return (0);
+	if (!(base->evsel->features & EV_FEATURE_THREADS))
+		return (-1);
+#ifndef WIN32
+	evsignal_enable_threads(base);
+#endif
+
+#ifdef HAVE_EVENTFD
+	base->th_notify_fd[0] = eventfd(0, 0);
+	if (base->th_notify_fd[0] == -1)
+		return (-1);
+	base->th_notify_fd[1] = base->th_notify_fd[0];
+#else
+	if (pipe(base->th_notify_fd) == -1)
+		return (-1);
+#endif
+	for (i = 0; i < 2; i++) {
+		fcntl(base->th_notify_fd[i], F_SETFL, O_NONBLOCK);
+		fcntl(base->th_notify_fd[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	event_set(&base->th_notify, base->th_notify_fd[0], EV_READ|EV_PERSIST,
+	    evthread_notify_cb, base);
+	event_base_set(base, &base->th_notify);
+	base->th_notify.ev_flags |= EVLIST_INTERNAL;
+	if (event_add(&base->th_notify, NULL) == -1)
+		goto fail;
+
+	if ((base->th_lock = malloc(sizeof(pthread_mutex_t))) == NULL)
+		goto fail;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(base->th_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return (0);
+
+ fail:
+	event_del(&base->th_notify);
+	close(base->th_notify_fd[0]);
+	if (base->th_notify_fd[1] != base->th_notify_fd[0])
+		close(base->th_notify_fd[1]);
+	return (-1);
+#else
+	return (-1);
+#endif
+}
 
 void
-event_init(void)
+event_base_thread_stats(struct event_base *base, unsigned long *wakeups)
+{
+	EVBASE_ACQUIRE_LOCK(base);
+	if (wakeups != NULL)
+		*wakeups = base->th_wakeups;
+	EVBASE_RELEASE_LOCK(base);
+}
+
+/*
+ * Pushes the callback onto the posted stack of the base.  Producers only
+ * compete on a compare-and-swap of the head; the one that finds the
+ * stack empty wakes up the loop, so a burst of posts costs one write.
+ */
+int
+event_base_post(struct event_base *base, void (*cb)(void *), void *arg)
+{
+	struct event_post *post, *head;
+
+#ifdef HAVE_LIBPTHREAD
+	if (base->th_lock == NULL)
+		return (-1);
+#else
+	return (-1);
+#endif
+
+	if ((post = malloc(sizeof(struct event_post))) == NULL)
+		return (-1);
+	post->cb = cb;
+	post->arg = arg;
+
+#ifdef HAVE_SYNC_BUILTINS
+	do {
+		head = base->post_head;
+		post->next = head;
+	} while (!__sync_bool_compare_and_swap(&base->post_head, head, post));
+#else
+	EVBASE_ACQUIRE_LOCK(base);
+	head = base->post_head;
+	post->next = head;
+	base->post_head = post;
+	EVBASE_RELEASE_LOCK(base);
+#endif
+
+	if (head == NULL) {
+#ifdef HAVE_EVENTFD
+		u_int64_t one = 1;
+		write(base->th_notify_fd[1], &one, sizeof(one));
+#else
+		write(base->th_notify_fd[1], "", 1);
+#endif
+	}
+
+	return (0);
+}
+
+/* Takes all posted callbacks at once and runs them in posting order */
+static int
+event_process_posted(struct event_base *base)
+{
+	struct event_post *post, *next, *list = NULL;
+	int n = 0;
+
+	if (base->post_head == NULL)
+		return (0);
+
+#ifdef HAVE_SYNC_BUILTINS
+	post = __sync_lock_test_and_set(&base->post_head, NULL);
+#else
+	post = base->post_head;
+	base->post_head = NULL;
+#endif
+
+	for (; post != NULL; post = next) {
+		next = post->next;
+		post->next = list;
+		list = post;
+	}
+
+	for (post = list; post != NULL; post = next) {
+		next = post->next;
+		(*post->cb)(post->arg);
+		free(post);
+		n++;
+	}
+
+	return (n);
+}
+
+struct event_base *
+event_base_new(void)
 {
 	int i;
+	struct event_base *base;
 
-	event_sigcb = NULL;
-	event_gotsig = 0;
-	gettimeofday(&event_tv, NULL);
+	if ((base = calloc(1, sizeof(struct event_base))) == NULL)
+		err(1, "%s: calloc", __func__);
+
+	detect_monotonic();
+	event_gettime(&base->event_tv);
 	
 #if defined(USE_LOG) && defined(USE_DEBUG)
 	log_to(stderr);
 	log_debug_cmd(LOG_MISC, 80);
 #endif
 
-	RB_INIT(&timetree);
-	TAILQ_INIT(&eventqueue);
-	TAILQ_INIT(&activequeue);
-	TAILQ_INIT(&signalqueue);
+	min_heap_ctor(&base->timeheap);
+	TAILQ_INIT(&base->eventqueue);
+	TAILQ_INIT(&base->signalqueue);
 	
 	/*
 	按优先顺序，选择一个evbase来初始化。
 	*/
-	evbase = NULL;
-	for (i = 0; eventops[i] && !evbase; i++) {
-		evsel = eventops[i];
+	base->evbase = NULL;
+	for (i = 0; eventops[i] && !base->evbase; i++) {
+		base->evsel = eventops[i];
 		/*
 		可通过环境变量控制，返回NULL
 		*/
-		evbase = evsel->init();
+		base->evbase = base->evsel->init(base);
 	}
 
-	if (evbase == NULL)
+	if (base->evbase == NULL)
 		errx(1, "%s: no event mechanism available", __func__);
 
 	/*
 	打印后端名字
 	*/
 	if (getenv("EVENT_SHOW_METHOD")) 
-		fprintf(stderr, "libevent using: %s\n", evsel->name); 
+		fprintf(stderr, "libevent using: %s\n", base->evsel->name); 
+
+	/* allocate a single active event queue */
+	if (event_base_priority_init(base, 1) == -1)
+		err(1, "%s: calloc", __func__);
+
+	return (base);
+}
+
+const char *
+event_base_get_method(struct event_base *base)
+{
+	return (base->evsel->name);
+}
+
+void
+event_base_free(struct event_base *base)
+{
+	int i;
+
+	if (base == NULL && current_base)
+		base = current_base;
+	if (base == current_base)
+		current_base = NULL;
+
+	assert(base);
+
+#ifdef HAVE_LIBPTHREAD
+	if (base->th_lock != NULL) {
+		pthread_mutex_t *lock = base->th_lock;
+
+		base->th_lock = NULL;
+		event_del(&base->th_notify);
+		close(base->th_notify_fd[0]);
+		if (base->th_notify_fd[1] != base->th_notify_fd[0])
+			close(base->th_notify_fd[1]);
+		pthread_mutex_destroy(lock);
+		free(lock);
+	}
+#endif
+
+	event_once_flush(base);
+
+	/* Callbacks that were never run are dropped */
+	while (base->post_head != NULL) {
+		struct event_post *post = base->post_head;
+
+		base->post_head = post->next;
+		free(post);
+	}
+
+	/* The backend removes its internal events before we check */
+	if (base->evsel->dealloc != NULL)
+		base->evsel->dealloc(base, base->evbase);
+
+	assert(TAILQ_FIRST(&base->eventqueue) == NULL);
+	assert(TAILQ_FIRST(&base->signalqueue) == NULL);
+	for (i = 0; i < base->n_common_timeouts; i++) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+
+		event_del(&ctl->timeout_event);
+		assert(TAILQ_FIRST(&ctl->events) == NULL);
+		free(ctl);
+	}
+	if (base->common_timeout_queues != NULL)
+		free(base->common_timeout_queues);
+
+	assert(min_heap_empty(&base->timeheap));
+	min_heap_dtor(&base->timeheap);
+	if (base->timewheel != NULL)
+		timewheel_free(base->timewheel);
+
+	for (i = 0; i < base->nactivequeues; i++)
+		assert(TAILQ_FIRST(&base->activequeues[i]) == NULL);
+	free(base->activequeues);
+
+	free(base);
+}
+
+/*
+ * Keeps all timeouts of this base in a timing wheel with the given
+ * granularity instead of the heap.  Timeouts are rounded up to the next
+ * tick, in exchange adding and deleting them does not depend on the
+ * number of pending timeouts.
+ */
+int
+event_base_timewheel_init(struct event_base *base, struct timeval *granularity)
+{
+	if (granularity == NULL || !timerisset(granularity) ||
+	    granularity->tv_sec < 0 || granularity->tv_usec < 0)
+		return (-1);
+
+	/* Pending timeouts cannot move between heap and wheel */
+	if (!min_heap_empty(&base->timeheap) ||
+	    (base->timewheel != NULL && base->timewheel->tw_count))
+		return (-1);
+
+	if (base->timewheel != NULL)
+		timewheel_free(base->timewheel);
+	if ((base->timewheel = timewheel_new(granularity)) == NULL)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Lets timeouts fire up to slack late, so that timeouts which expire
+ * close to each other are processed by one wakeup of the loop.
+ */
+int
+event_base_set_timer_slack(struct event_base *base, struct timeval *slack)
+{
+	if (slack == NULL) {
+		timerclear(&base->timer_slack);
+		return (0);
+	}
+	if (slack->tv_sec < 0 || slack->tv_usec < 0 ||
+	    slack->tv_usec >= 1000000)
+		return (-1);
+
+	base->timer_slack = *slack;
+	return (0);
+}
+
+/*
+ * Lets the loop poll the backend without blocking for up to budget
+ * before it goes to sleep, which saves the wakeup latency when events
+ * follow each other closely.
+ */
+int
+event_base_set_busy_poll(struct event_base *base, struct timeval *budget)
+{
+	if (budget == NULL) {
+		base->busy_poll_max = base->busy_poll_cur = 0;
+		return (0);
+	}
+	if (budget->tv_sec < 0 || budget->tv_usec < 0 ||
+	    budget->tv_usec >= 1000000 || budget->tv_sec != 0)
+		return (-1);
+
+	base->busy_poll_max = budget->tv_usec;
+	base->busy_poll_cur = base->busy_poll_max;
+	return (0);
+}
+
+void
+event_base_busy_poll_stats(struct event_base *base, unsigned long *hits,
+    unsigned long *sleeps)
+{
+	EVBASE_ACQUIRE_LOCK(base);
+	if (hits != NULL)
+		*hits = base->busy_poll_hits;
+	if (sleeps != NULL)
+		*sleeps = base->busy_poll_sleeps;
+	EVBASE_RELEASE_LOCK(base);
 }
 
 int
-event_haveevents(void)
+event_priority_init(int npriorities)
 {
-	return (event_count > 0);
+	return (event_base_priority_init(current_base, npriorities));
 }
 
+/*
+ * Sets the number of priorities of the base.  Priority 0 is the most
+ * important one; events get the middle priority by default.
+ */
+int
+event_base_priority_init(struct event_base *base, int npriorities)
+{
+	struct event_list *queues;
+	int i;
+
+	if (base->event_count_active || npriorities < 1)
+		return (-1);
+
+	if (npriorities == base->nactivequeues)
+		return (0);
+
+	queues = calloc(npriorities, sizeof(struct event_list));
+	if (queues == NULL)
+		return (-1);
+	for (i = 0; i < npriorities; i++)
+		TAILQ_INIT(&queues[i]);
+
+	if (base->activequeues != NULL)
+		free(base->activequeues);
+	base->activequeues = queues;
+	base->nactivequeues = npriorities;
+
+	return (0);
+}
+
+static int
+event_haveevents(struct event_base *base)
+{
+	return (base->event_count > 0);
+}
+
+/*
+ * Active events are stored in priority queues.  Lower priorities are
+ * always processed before higher priorities.  Low priority events can
+ * starve high priority ones.
+ */
+
 static void
-event_process_active(void)
+event_process_active(struct event_base *base)
 {
 	struct event *ev;
+	struct event_list *activeq = NULL;
+	int i;
 	short ncalls;
 
-	for (ev = TAILQ_FIRST(&activequeue); ev;
-	    ev = TAILQ_FIRST(&activequeue)) {
-		event_queue_remove(ev, EVLIST_ACTIVE);
+	for (i = 0; i < base->nactivequeues; ++i) {
+		if (TAILQ_FIRST(&base->activequeues[i]) != NULL) {
+			activeq = &base->activequeues[i];
+			break;
+		}
+	}
+
+	assert(activeq != NULL);
+
+	for (ev = TAILQ_FIRST(activeq); ev; ev = TAILQ_FIRST(activeq)) {
+		event_queue_remove(base, ev, EVLIST_ACTIVE);
 		
 		/* Allows deletes to work */
 		ncalls = ev->ev_ncalls;
@@ -228,33 +746,64 @@ event_dispatch(void)
 	return (event_loop(0));
 }
 
+int
+event_base_dispatch(struct event_base *base)
+{
+	return (event_base_loop(base, 0));
+}
+
 static void
 event_loopexit_cb(int fd, short what, void *arg)
 {
-	event_gotterm = 1;
+	struct event_base *base = arg;
+	base->event_gotterm = 1;
 }
 
 int
 event_loopexit(struct timeval *tv)
 {
-	return (event_once(-1, EV_TIMEOUT, event_loopexit_cb, NULL, tv));
+	return (event_base_loopexit(current_base, tv));
+}
+
+int
+event_base_loopexit(struct event_base *base, struct timeval *tv)
+{
+	return (event_base_once(base, -1, EV_TIMEOUT, event_loopexit_cb,
+		    base, tv));
 }
 
 int
 event_loop(int flags)
 {
+	return (event_base_loop(current_base, flags));
+}
+
+int
+event_base_loop(struct event_base *base, int flags)
+{
+	const struct eventop *evsel = base->evsel;
+	void *evbase = base->evbase;
 	struct timeval tv;
-	int res, done;
+	int res, done, retval;
+
+	EVBASE_ACQUIRE_LOCK(base);
+#ifdef HAVE_LIBPTHREAD
+	base->th_owner = pthread_self();
+#endif
+	base->th_loop_running = 1;
 
 	/* Calculate the initial events that we are waiting for */
-	if (evsel->recalc(evbase, 0) == -1)
-		return (-1);
+	if (evsel->recalc(base, evbase, 0) == -1) {
+		retval = -1;
+		goto done;
+	}
 
+	retval = 0;
 	done = 0;
 	while (!done) {
 		/* Terminate the loop if we have been asked to */
-		if (event_gotterm) {
-			event_gotterm = 0;
+		if (base->event_gotterm) {
+			base->event_gotterm = 0;
 			break;
 		}
 
@@ -264,56 +813,144 @@ event_loop(int flags)
 				res = (*event_sigcb)();
 				if (res == -1) {
 					errno = EINTR;
-					return (-1);
+					retval = -1;
+					goto done;
 				}
 			}
 		}
 
-		/* Check if time is running backwards */
-		gettimeofday(&tv, NULL);
-		if (timercmp(&tv, &event_tv, <)) {
+		/*
+		 * Check if time is running backwards; only possible without
+		 * a monotonic clock, and then all deadlines need shifting.
+		 */
+		update_time_cache(base);
+		gettime(base, &tv);
+		if (!use_monotonic && timercmp(&tv, &base->event_tv, <)) {
 			struct timeval off;
 			LOG_DBG((LOG_MISC, 10,
 				    "%s: time is running backwards, corrected",
 				    __func__));
 
-			timersub(&event_tv, &tv, &off);
-			timeout_correct(&off);
+			timersub(&base->event_tv, &tv, &off);
+			timeout_correct(base, &off);
 		}
-		event_tv = tv;
+		base->event_tv = tv;
 		/*
 		 获取时间队列里，等待时间最少的时间，出来放入event里处理
 		 那么有多个事件咋整
 		*/
 
-		if (!(flags & EVLOOP_NONBLOCK))
-			timeout_next(&tv);
+		/* Events of less important priorities may still be active */
+		if (!(flags & EVLOOP_NONBLOCK) && !base->event_count_active)
+			timeout_next(base, &tv);
 		else
 			timerclear(&tv);
 		
 		/* If we have no events, we just exit */
-		if (!event_haveevents())
-			return (1);
+		if (!event_haveevents(base)) {
+			retval = 1;
+			goto done;
+		}
 
-		res = evsel->dispatch(evbase, &tv);
+		/* other threads may add timeouts while we wait */
+		clear_time_cache(base);
 
-		if (res == -1)
-			return (-1);
+		if (base->busy_poll_max && timerisset(&tv))
+			res = event_dispatch_busy_poll(base, &tv);
+		else
+			res = evsel->dispatch(base, evbase, &tv);
+
+		if (res == -1) {
+			retval = -1;
+			goto done;
+		}
+
+		/* timeouts and callbacks share one reading of the clock */
+		update_time_cache(base);
 
-		timeout_process();
+		timeout_process(base);
+
+		if (event_process_posted(base) && (flags & EVLOOP_ONCE))
+			done = 1;
 
-		if (TAILQ_FIRST(&activequeue)) {
-			event_process_active();
+		if (base->event_count_active) {
+			event_process_active(base);
 			if (flags & EVLOOP_ONCE)
 				done = 1;
 		} else if (flags & EVLOOP_NONBLOCK)
 			done = 1;
 
-		if (evsel->recalc(evbase, 0) == -1)
+		if (evsel->recalc(base, evbase, 0) == -1) {
+			retval = -1;
+			goto done;
+		}
+	}
+
+ done:
+	clear_time_cache(base);
+	base->th_loop_running = 0;
+	EVBASE_RELEASE_LOCK(base);
+	return (retval);
+}
+
+/*
+ * Dispatches with a zero timeout until an event shows up or the spin
+ * budget is used, and only then waits for the rest of tv.  Like halt
+ * polling, the budget doubles when an event arrived soon after we gave
+ * up spinning and halves when the wait was longer than the maximum
+ * budget, so a loop that mostly idles soon stops spinning.
+ */
+static int
+event_dispatch_busy_poll(struct event_base *base, struct timeval *tv)
+{
+	const struct eventop *evsel = base->evsel;
+	struct timeval start, now, limit, zero;
+	long waited;
+	int res;
+
+	event_gettime(&start);
+	limit.tv_sec = base->busy_poll_cur / 1000000;
+	limit.tv_usec = base->busy_poll_cur % 1000000;
+	if (timercmp(&limit, tv, >))
+		limit = *tv;
+	timeradd(&start, &limit, &limit);
+
+	now = start;
+	while (timercmp(&now, &limit, <)) {
+		/* the backends may modify the timeout */
+		timerclear(&zero);
+		if ((res = evsel->dispatch(base, base->evbase, &zero)) == -1)
 			return (-1);
+		if (base->event_count_active || base->post_head != NULL) {
+			base->busy_poll_hits++;
+			return (res);
+		}
+		event_gettime(&now);
 	}
 
-	return (0);
+	/* Wait for what is left of the timeout */
+	base->busy_poll_sleeps++;
+	timersub(&now, &start, &limit);
+	if (timercmp(&limit, tv, <))
+		timersub(tv, &limit, &limit);
+	else
+		timerclear(&limit);
+	res = evsel->dispatch(base, base->evbase, &limit);
+
+	event_gettime(&start);
+	timersub(&start, &now, &now);
+	waited = now.tv_sec ? 1000000 : now.tv_usec;
+	if (waited <= base->busy_poll_max) {
+		if (base->busy_poll_cur == 0)
+			base->busy_poll_cur = base->busy_poll_max / 16 + 1;
+		else
+			base->busy_poll_cur *= 2;
+		if (base->busy_poll_cur > base->busy_poll_max)
+			base->busy_poll_cur = base->busy_poll_max;
+	} else
+		base->busy_poll_cur /= 2;
+
+	return (res);
 }
 
 /* Sets up an event for processing once */
@@ -323,17 +960,64 @@ struct event_once {
 
 	void (*cb)(int, short, void *);
 	void *arg;
+
+	struct event_once *next;	/* in the cache of the base */
 };
 
-/* One-time callback, it deletes itself */
+/* Records kept per base for reuse instead of going back to malloc */
+#define EVENT_ONCE_CACHE_MAX	256
+
+static struct event_once *
+event_once_get(struct event_base *base)
+{
+	struct event_once *eonce;
+
+	if ((eonce = base->once_cache) != NULL) {
+		base->once_cache = eonce->next;
+		base->once_cached--;
+		return (eonce);
+	}
+
+	return (malloc(sizeof(struct event_once)));
+}
+
+static void
+event_once_put(struct event_base *base, struct event_once *eonce)
+{
+	if (base->once_cached >= EVENT_ONCE_CACHE_MAX) {
+		free(eonce);
+		return;
+	}
+
+	eonce->next = base->once_cache;
+	base->once_cache = eonce;
+	base->once_cached++;
+}
+
+static void
+event_once_flush(struct event_base *base)
+{
+	struct event_once *eonce;
+
+	while ((eonce = base->once_cache) != NULL) {
+		base->once_cache = eonce->next;
+		free(eonce);
+	}
+	base->once_cached = 0;
+}
+
+/* One-time callback, it recycles itself */
 
 static void
 event_once_cb(int fd, short events, void *arg)
 {
 	struct event_once *eonce = arg;
+	void (*cb)(int, short, void *) = eonce->cb;
+	void *cbarg = eonce->arg;
 
-	(*eonce->cb)(fd, events, eonce->arg);
-	free(eonce);
+	/* The callback may schedule the next one with this record */
+	event_once_put(eonce->ev.ev_base, eonce);
+	(*cb)(fd, events, cbarg);
 }
 
 /* Schedules an event once */
@@ -341,6 +1025,13 @@ event_once_cb(int fd, short events, void *arg)
 int
 event_once(int fd, short events,
     void (*callback)(int, short, void *), void *arg, struct timeval *tv)
+{
+	return (event_base_once(current_base, fd, events, callback, arg, tv));
+}
+
+int
+event_base_once(struct event_base *base, int fd, short events,
+    void (*callback)(int, short, void *), void *arg, struct timeval *tv)
 {
 	struct event_once *eonce;
 	struct timeval etv;
@@ -349,9 +1040,12 @@ event_once(int fd, short events,
 	if (events & EV_SIGNAL)
 		return (-1);
 
-	if ((eonce = calloc(1, sizeof(struct event_once))) == NULL)
+	if ((eonce = event_once_get(base)) == NULL)
 		return (-1);
 
+	eonce->cb = callback;
+	eonce->arg = arg;
+
 	if (events == EV_TIMEOUT) {
 		if (tv == NULL) {
 			//返回一个空时间
@@ -359,9 +1053,6 @@ event_once(int fd, short events,
 			tv = &etv;
 		}
 
-		eonce->cb = callback;
-		eonce->arg = arg;
-
 		evtimer_set(&eonce->ev, event_once_cb, eonce);
 	} else if (events & (EV_READ|EV_WRITE)) {
 		events &= EV_READ|EV_WRITE;
@@ -369,9 +1060,11 @@ event_once(int fd, short events,
 		event_set(&eonce->ev, fd, events, event_once_cb, eonce);
 	} else {
 		/* Bad event combination */
+		event_once_put(base, eonce);
 		return (-1);
 	}
 
+	event_base_set(base, &eonce->ev);
 	event_add(&eonce->ev, tv);
 
 	return (0);
@@ -381,6 +1074,9 @@ void
 event_set(struct event *ev, int fd, short events,
 	  void (*callback)(int, short, void *), void *arg)
 {
+	/* Take the current base - caller needs to set the real base later */
+	ev->ev_base = current_base;
+
 	ev->ev_callback = callback;
 	ev->ev_arg = arg;
 #ifdef WIN32
@@ -393,6 +1089,49 @@ event_set(struct event *ev, int fd, short events,
 	ev->ev_flags = EVLIST_INIT;
 	ev->ev_ncalls = 0;
 	ev->ev_pncalls = NULL;
+	ev->ev_buffer = NULL;
+	ev->ev_iobytes = 0;
+	ev->ev_ioerror = 0;
+	timerclear(&ev->ev_period);
+
+	min_heap_elem_init(ev);
+
+	/* by default, we put new events into the middle priority */
+	if (current_base != NULL)
+		ev->ev_pri = current_base->nactivequeues / 2;
+	else
+		ev->ev_pri = 0;
+}
+
+int
+event_base_set(struct event_base *base, struct event *ev)
+{
+	/* Only innocent events may be assigned to a different base */
+	if (ev->ev_flags != EVLIST_INIT)
+		return (-1);
+
+	ev->ev_base = base;
+	ev->ev_pri = base->nactivequeues / 2;
+
+	return (0);
+}
+
+/*
+ * Sets the priority of an event - if an event is already scheduled
+ * changing the priority is going to fail.
+ */
+
+int
+event_priority_set(struct event *ev, int pri)
+{
+	if (ev->ev_flags & EVLIST_ACTIVE || ev->ev_base == NULL)
+		return (-1);
+	if (pri < 0 || pri >= ev->ev_base->nactivequeues)
+		return (-1);
+
+	ev->ev_pri = pri;
+
+	return (0);
 }
 
 /*
@@ -416,8 +1155,21 @@ event_pending(struct event *ev, short event, struct timeval *tv)
 	event &= (EV_TIMEOUT|EV_READ|EV_WRITE|EV_SIGNAL);
 
 	/* See if there is a timeout that we should report */
-	if (tv != NULL && (flags & event & EV_TIMEOUT))
-		*tv = ev->ev_timeout;
+	if (tv != NULL && (flags & event & EV_TIMEOUT)) {
+		struct timeval tmp = ev->ev_timeout;
+
+		tmp.tv_usec &= COMMON_TIMEOUT_MICROSECONDS_MASK;
+		if (use_monotonic) {
+			/* The caller wants to see the wall clock */
+			struct timeval now, wall;
+
+			event_gettime(&now);
+			gettimeofday(&wall, NULL);
+			timersub(&tmp, &now, &tmp);
+			timeradd(&wall, &tmp, tv);
+		} else
+			*tv = tmp;
+	}
 
 	return (flags & event);
 }
@@ -425,6 +1177,25 @@ event_pending(struct event *ev, short event, struct timeval *tv)
 int
 event_add(struct event *ev, struct timeval *tv)
 {
+	struct event_base *base = ev->ev_base;
+	int res;
+
+	EVBASE_ACQUIRE_LOCK(base);
+	res = event_add_internal(ev, tv);
+	evthread_notify(base);
+	EVBASE_RELEASE_LOCK(base);
+
+	return (res);
+}
+
+static int
+event_add_internal(struct event *ev, struct timeval *tv)
+{
+	struct event_base *base = ev->ev_base;
+	const struct eventop *evsel = base->evsel;
+	void *evbase = base->evbase;
+	int queue;
+
 	LOG_DBG((LOG_MISC, 55,
 		 "event_add: event: %p, %s%s%scall %p",
 		 ev,
@@ -435,11 +1206,28 @@ event_add(struct event *ev, struct timeval *tv)
 
 	assert(!(ev->ev_flags & ~EVLIST_ALL));
 
+	/* Level triggered emulation would spin on undrained fds */
+	if ((ev->ev_events & EV_ET) && !(evsel->features & EV_FEATURE_ET))
+		return (-1);
+	if ((ev->ev_events & EV_COMPLETION) && evsel->completion == NULL)
+		return (-1);
+
+	/*
+	 * Prepare for timeout insertion further below; if we get a
+	 * failure here we have not changed anything yet.
+	 */
+	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT) &&
+	    base->timewheel == NULL && !is_common_timeout(tv, base)) {
+		if (min_heap_reserve(&base->timeheap,
+			1 + min_heap_size(&base->timeheap)) == -1)
+			return (-1);	/* ENOMEM == errno */
+	}
+
 	if (tv != NULL) {
 		struct timeval now;
 
 		if (ev->ev_flags & EVLIST_TIMEOUT)
-			event_queue_remove(ev, EVLIST_TIMEOUT);
+			event_queue_remove(base, ev, EVLIST_TIMEOUT);
 
 		/* Check if it is active due to a timeout.  Rescheduling
 		 * this timeout before the callback can be executed
@@ -457,29 +1245,48 @@ event_add(struct event *ev, struct timeval *tv)
 				*ev->ev_pncalls = 0;
 			}
 			
-			event_queue_remove(ev, EVLIST_ACTIVE);
+			event_queue_remove(base, ev, EVLIST_ACTIVE);
 		}
 
-		gettimeofday(&now, NULL);
-		timeradd(&now, tv, &ev->ev_timeout);
+		gettime(base, &now);
+		if (is_common_timeout(tv, base)) {
+			struct timeval duration = *tv;
+
+			duration.tv_usec &= COMMON_TIMEOUT_MICROSECONDS_MASK;
+			timeradd(&now, &duration, &ev->ev_timeout);
+			ev->ev_timeout.tv_usec |=
+			    (tv->tv_usec & ~COMMON_TIMEOUT_MICROSECONDS_MASK);
+		} else
+			timeradd(&now, tv, &ev->ev_timeout);
+
+		/* A timer that persists fires again every tv */
+		if ((ev->ev_events & (EV_READ|EV_WRITE|EV_SIGNAL|EV_PERSIST)) ==
+		    EV_PERSIST)
+			ev->ev_period = *tv;
 
 		LOG_DBG((LOG_MISC, 55,
 			 "event_add: timeout in %d seconds, call %p",
 			 tv->tv_sec, ev->ev_callback));
 
-		event_queue_insert(ev, EVLIST_TIMEOUT);
+		event_queue_insert(base, ev, EVLIST_TIMEOUT);
 	}
 
 	if ((ev->ev_events & (EV_READ|EV_WRITE)) &&
-	    !(ev->ev_flags & (EVLIST_INSERTED|EVLIST_ACTIVE))) {
-		event_queue_insert(ev, EVLIST_INSERTED);
-
-		return (evsel->add(evbase, ev));
-	} else if ((ev->ev_events & EV_SIGNAL) &&
-	    !(ev->ev_flags & EVLIST_SIGNAL)) {
-		event_queue_insert(ev, EVLIST_SIGNAL);
+	    !(ev->ev_flags & (EVLIST_INSERTED|EVLIST_ACTIVE)))
+		queue = EVLIST_INSERTED;
+	else if ((ev->ev_events & EV_SIGNAL) &&
+	    !(ev->ev_flags & EVLIST_SIGNAL))
+		queue = EVLIST_SIGNAL;
+	else
+		return (0);
 
-		return (evsel->add(evbase, ev));
+	event_queue_insert(base, ev, queue);
+	if (evsel->add(evbase, ev) == -1) {
+		/* The backend refused the event; it must not stay pending */
+		event_queue_remove(base, ev, queue);
+		if (tv != NULL)
+			event_queue_remove(base, ev, EVLIST_TIMEOUT);
+		return (-1);
 	}
 
 	return (0);
@@ -488,9 +1295,35 @@ event_add(struct event *ev, struct timeval *tv)
 int
 event_del(struct event *ev)
 {
+	struct event_base *base = ev->ev_base;
+	int res;
+
+	/* An event without a base has not been added */
+	if (base == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base);
+	res = event_del_internal(ev);
+	evthread_notify(base);
+	EVBASE_RELEASE_LOCK(base);
+
+	return (res);
+}
+
+static int
+event_del_internal(struct event *ev)
+{
+	struct event_base *base;
+	const struct eventop *evsel;
+	void *evbase;
+
 	LOG_DBG((LOG_MISC, 80, "event_del: %p, callback %p",
 		 ev, ev->ev_callback));
 
+	base = ev->ev_base;
+	evsel = base->evsel;
+	evbase = base->evbase;
+
 	assert(!(ev->ev_flags & ~EVLIST_ALL));
 
 	/* See if we are just active executing this event in a loop */
@@ -500,16 +1333,16 @@ event_del(struct event *ev)
 	}
 
 	if (ev->ev_flags & EVLIST_TIMEOUT)
-		event_queue_remove(ev, EVLIST_TIMEOUT);
+		event_queue_remove(base, ev, EVLIST_TIMEOUT);
 
 	if (ev->ev_flags & EVLIST_ACTIVE)
-		event_queue_remove(ev, EVLIST_ACTIVE);
+		event_queue_remove(base, ev, EVLIST_ACTIVE);
 
 	if (ev->ev_flags & EVLIST_INSERTED) {
-		event_queue_remove(ev, EVLIST_INSERTED);
+		event_queue_remove(base, ev, EVLIST_INSERTED);
 		return (evsel->del(evbase, ev));
 	} else if (ev->ev_flags & EVLIST_SIGNAL) {
-		event_queue_remove(ev, EVLIST_SIGNAL);
+		event_queue_remove(base, ev, EVLIST_SIGNAL);
 		return (evsel->del(evbase, ev));
 	}
 
@@ -519,6 +1352,19 @@ event_del(struct event *ev)
 void
 event_active(struct event *ev, int res, short ncalls)
 {
+	struct event_base *base = ev->ev_base;
+
+	EVBASE_ACQUIRE_LOCK(base);
+	event_active_internal(ev, res, ncalls);
+	evthread_notify(base);
+	EVBASE_RELEASE_LOCK(base);
+}
+
+static void
+event_active_internal(struct event *ev, int res, short ncalls)
+{
+	struct event_base *base = ev->ev_base;
+
 	/* We get different kinds of events, add them together */
 	if (ev->ev_flags & EVLIST_ACTIVE) {
 		ev->ev_res |= res;
@@ -528,27 +1374,194 @@ event_active(struct event *ev, int res, short ncalls)
 	ev->ev_res = res;
 	ev->ev_ncalls = ncalls;
 	ev->ev_pncalls = NULL;
-	event_queue_insert(ev, EVLIST_ACTIVE);
+	event_queue_insert(base, ev, EVLIST_ACTIVE);
+}
+
+static int
+is_common_timeout(struct timeval *tv, struct event_base *base)
+{
+	if ((tv->tv_usec & COMMON_TIMEOUT_MASK) != COMMON_TIMEOUT_MAGIC)
+		return (0);
+	return (COMMON_TIMEOUT_IDX(tv) < base->n_common_timeouts);
+}
+
+/* Adds the internal event of the list so that it fires for head */
+static void
+common_timeout_schedule(struct common_timeout_list *ctl,
+    struct timeval *now, struct event *head)
+{
+	struct timeval timeout = head->ev_timeout;
+
+	timeout.tv_usec &= COMMON_TIMEOUT_MICROSECONDS_MASK;
+	if (timercmp(&timeout, now, >))
+		timersub(&timeout, now, &timeout);
+	else
+		timerclear(&timeout);
+	event_add_internal(&ctl->timeout_event, &timeout);
+}
+
+/*
+ * All events on the list have the same duration, so a new one almost
+ * always belongs at the tail.  Only a backwards clock can make us walk.
+ */
+static void
+common_timeout_insert(struct common_timeout_list *ctl, struct event *ev)
+{
+	struct event *e;
+	struct timeval now;
+
+	for (e = TAILQ_LAST(&ctl->events, event_list); e != NULL;
+	    e = TAILQ_PREV(e, event_list, ev_timeout_pos.list.ev_timeout_next)) {
+		if (!timercmp(&ev->ev_timeout, &e->ev_timeout, <)) {
+			TAILQ_INSERT_AFTER(&ctl->events, e, ev,
+			    ev_timeout_pos.list.ev_timeout_next);
+			return;
+		}
+	}
+
+	/* The new event is the earliest; it decides when the list fires */
+	TAILQ_INSERT_HEAD(&ctl->events, ev, ev_timeout_pos.list.ev_timeout_next);
+	gettime(ctl->base, &now);
+	common_timeout_schedule(ctl, &now, ev);
+}
+
+static void
+common_timeout_callback(int fd, short what, void *arg)
+{
+	struct common_timeout_list *ctl = arg;
+	struct timeval now, deadline;
+	struct event *ev;
+
+	gettime(ctl->base, &now);
+	while ((ev = TAILQ_FIRST(&ctl->events)) != NULL) {
+		deadline = ev->ev_timeout;
+		deadline.tv_usec &= COMMON_TIMEOUT_MICROSECONDS_MASK;
+		if (timercmp(&deadline, &now, >))
+			break;
+
+		event_timeout_expire(ev, &now);
+	}
+
+	if (ev != NULL)
+		common_timeout_schedule(ctl, &now, ev);
+}
+
+/*
+ * Returns a handle for timeouts of the given duration.  Events added
+ * with the handle are appended to a list instead of the heap or wheel,
+ * which makes rescheduling them O(1).
+ */
+struct timeval *
+event_base_init_common_timeout(struct event_base *base,
+    struct timeval *duration)
+{
+	struct common_timeout_list *ctl;
+	struct timeval tv;
+	int i;
+
+	if (is_common_timeout(duration, base))
+		return (duration);
+
+	tv = *duration;
+	if (tv.tv_sec < 0 || tv.tv_usec < 0)
+		return (NULL);
+	if (tv.tv_usec >= 1000000) {
+		tv.tv_sec += tv.tv_usec / 1000000;
+		tv.tv_usec %= 1000000;
+	}
+
+	for (i = 0; i < base->n_common_timeouts; i++) {
+		ctl = base->common_timeout_queues[i];
+		if (ctl->duration.tv_sec == tv.tv_sec &&
+		    (ctl->duration.tv_usec & COMMON_TIMEOUT_MICROSECONDS_MASK)
+		    == tv.tv_usec)
+			return (&ctl->duration);
+	}
+
+	if (base->n_common_timeouts == MAX_COMMON_TIMEOUTS)
+		return (NULL);
+
+	if (base->n_common_timeouts == base->n_common_timeouts_allocated) {
+		struct common_timeout_list **queues;
+		int n = base->n_common_timeouts_allocated ?
+		    base->n_common_timeouts_allocated * 2 : 16;
+
+		queues = realloc(base->common_timeout_queues,
+		    n * sizeof(struct common_timeout_list *));
+		if (queues == NULL)
+			return (NULL);
+		base->common_timeout_queues = queues;
+		base->n_common_timeouts_allocated = n;
+	}
+
+	if ((ctl = calloc(1, sizeof(struct common_timeout_list))) == NULL)
+		return (NULL);
+	TAILQ_INIT(&ctl->events);
+	ctl->duration.tv_sec = tv.tv_sec;
+	ctl->duration.tv_usec = tv.tv_usec | COMMON_TIMEOUT_MAGIC |
+	    (base->n_common_timeouts << COMMON_TIMEOUT_IDX_SHIFT);
+	ctl->base = base;
+
+	evtimer_set(&ctl->timeout_event, common_timeout_callback, ctl);
+	event_base_set(base, &ctl->timeout_event);
+	ctl->timeout_event.ev_flags |= EVLIST_INTERNAL;
+
+	base->common_timeout_queues[base->n_common_timeouts++] = ctl;
+
+	return (&ctl->duration);
 }
 
 /*
 下一个事件要等待多少秒钟
 如果没有时间事件，则默认等待5秒
 */
-int
-timeout_next(struct timeval *tv)
+/*
+ * Moves a wakeup that is due in tv to the next multiple of the timer
+ * slack.  Every timeout due within the same slack period is then
+ * expired by the same wakeup.
+ */
+static void
+timeout_slack(struct event_base *base, struct timeval *now, struct timeval *tv)
+{
+	u_int64_t slack, start, when;
+
+	slack = (u_int64_t)base->timer_slack.tv_sec * 1000000 +
+	    base->timer_slack.tv_usec;
+	if (slack == 0 || !timerisset(tv))
+		return;
+
+	start = (u_int64_t)now->tv_sec * 1000000 + now->tv_usec;
+	when = start + (u_int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+	when = (when + slack - 1) / slack * slack - start;
+
+	tv->tv_sec = when / 1000000;
+	tv->tv_usec = when % 1000000;
+}
+
+static int
+timeout_next(struct event_base *base, struct timeval *tv)
 {
 	struct timeval dflt = TIMEOUT_DEFAULT;
 
 	struct timeval now;
 	struct event *ev;
 
-	if ((ev = RB_MIN(event_tree, &timetree)) == NULL) {
+	if (base->timewheel != NULL) {
+		if (gettime(base, &now) == -1)
+			return (-1);
+		if (!timewheel_next(base->timewheel, &now, tv))
+			*tv = dflt;
+		else
+			timeout_slack(base, &now, tv);
+		return (0);
+	}
+
+	if ((ev = min_heap_top(&base->timeheap)) == NULL) {
 		*tv = dflt;
 		return (0);
 	}
 
-	if (gettimeofday(&now, NULL) == -1)
+	if (gettime(base, &now) == -1)
 		return (-1);
 
 	if (timercmp(&ev->ev_timeout, &now, <=)) {
@@ -561,105 +1574,209 @@ timeout_next(struct timeval *tv)
 	assert(tv->tv_sec >= 0);
 	assert(tv->tv_usec >= 0);
 
+	timeout_slack(base, &now, tv);
+
 	LOG_DBG((LOG_MISC, 60, "timeout_next: in %d seconds", tv->tv_sec));
 	return (0);
 }
 
-void
-timeout_correct(struct timeval *off)
+static void
+timeout_correct(struct event_base *base, struct timeval *off)
 {
-	struct event *ev;
+	struct event **pev, *ev;
+	unsigned int size;
+	int i;
+
+	for (i = 0; i < base->n_common_timeouts; i++) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+
+		TAILQ_FOREACH(ev, &ctl->events,
+		    ev_timeout_pos.list.ev_timeout_next) {
+			long bits = ev->ev_timeout.tv_usec &
+			    ~COMMON_TIMEOUT_MICROSECONDS_MASK;
+
+			ev->ev_timeout.tv_usec &=
+			    COMMON_TIMEOUT_MICROSECONDS_MASK;
+			timersub(&ev->ev_timeout, off, &ev->ev_timeout);
+			ev->ev_timeout.tv_usec |= bits;
+		}
+	}
+
+	if (base->timewheel != NULL) {
+		timewheel_correct(base->timewheel, off);
+		return;
+	}
 
 	/*
 	 * We can modify the key element of the node without destroying
-	 * the key, beause we apply it to all in the right order.
+	 * the heap property, because we apply it to all in the same way.
 	 */
-	RB_FOREACH(ev, event_tree, &timetree)
-		timersub(&ev->ev_timeout, off, &ev->ev_timeout);
+	pev = base->timeheap.p;
+	size = base->timeheap.n;
+	for (; size-- > 0; ++pev)
+		timersub(&(*pev)->ev_timeout, off, &(*pev)->ev_timeout);
 }
 
-void
-timeout_process(void)
+static void
+timeout_process(struct event_base *base)
 {
 	struct timeval now;
-	struct event *ev, *next;
+	struct event *ev;
 
-	gettimeofday(&now, NULL);
+	gettime(base, &now);
 
-	for (ev = RB_MIN(event_tree, &timetree); ev; ev = next) {
+	if (base->timewheel != NULL) {
+		timewheel_process(base->timewheel, &now);
+		return;
+	}
+
+	while ((ev = min_heap_top(&base->timeheap)) != NULL) {
 		/*
 		如果现在最少的等待时间的事件，大于当前时间。
 		则说明没有事件发生。退出。
 		*/
 		if (timercmp(&ev->ev_timeout, &now, >))
 			break;
-		next = RB_NEXT(event_tree, &timetree, ev);
-
-		event_queue_remove(ev, EVLIST_TIMEOUT);
-
-		/* delete this event from the I/O queues */
-		event_del(ev);
 
 		LOG_DBG((LOG_MISC, 60, "timeout_process: call %p",
 			 ev->ev_callback));
-		event_active(ev, EV_TIMEOUT, 1);
+		event_timeout_expire(ev, &now);
 	}
 }
 
+/*
+ * Moves a periodic timer to its next deadline.  The period is added to
+ * the deadline that just expired rather than to now, so the timer does
+ * not drift; periods that were missed entirely are skipped.
+ */
+static void
+timeout_reschedule(struct event_base *base, struct event *ev,
+    struct timeval *now)
+{
+	struct timeval deadline = ev->ev_timeout, period = ev->ev_period;
+	long bits = deadline.tv_usec & ~COMMON_TIMEOUT_MICROSECONDS_MASK;
+
+	deadline.tv_usec &= COMMON_TIMEOUT_MICROSECONDS_MASK;
+	period.tv_usec &= COMMON_TIMEOUT_MICROSECONDS_MASK;
+	timeradd(&deadline, &period, &deadline);
+	if (!timercmp(&deadline, now, >)) {
+		struct timeval behind;
+		u_int64_t usec;
+
+		timersub(now, &deadline, &behind);
+		usec = (u_int64_t)period.tv_sec * 1000000 + period.tv_usec;
+		usec *= ((u_int64_t)behind.tv_sec * 1000000 +
+		    behind.tv_usec) / usec + 1;
+		behind.tv_sec = usec / 1000000;
+		behind.tv_usec = usec % 1000000;
+		timeradd(&deadline, &behind, &deadline);
+	}
+
+	/* The deadline only grows, so the heap is fixed up in place */
+	if (!bits && base->timewheel == NULL) {
+		ev->ev_timeout = deadline;
+		min_heap_shift_down_(&base->timeheap, MIN_HEAP_IDX(ev), ev);
+		return;
+	}
+
+	event_queue_remove(base, ev, EVLIST_TIMEOUT);
+	deadline.tv_usec |= bits;
+	ev->ev_timeout = deadline;
+	event_queue_insert(base, ev, EVLIST_TIMEOUT);
+}
+
 void
-event_queue_remove(struct event *ev, int queue)
+event_timeout_expire(struct event *ev, struct timeval *now)
+{
+	if (timerisset(&ev->ev_period))
+		timeout_reschedule(ev->ev_base, ev, now);
+	else {
+		/* delete this event from the I/O queues */
+		event_del_internal(ev);
+	}
+
+	event_active_internal(ev, EV_TIMEOUT, 1);
+}
+
+static void
+event_queue_remove(struct event_base *base, struct event *ev, int queue)
 {
 	if (!(ev->ev_flags & queue))
 		errx(1, "%s: %p(fd %d) not on queue %x", __func__,
 		    ev, ev->ev_fd, queue);
 
 	if (!(ev->ev_flags & EVLIST_INTERNAL))
-		event_count--;
+		base->event_count--;
 
 	ev->ev_flags &= ~queue;
 	switch (queue) {
 	case EVLIST_ACTIVE:
-		TAILQ_REMOVE(&activequeue, ev, ev_active_next);
+		base->event_count_active--;
+		TAILQ_REMOVE(&base->activequeues[ev->ev_pri],
+		    ev, ev_active_next);
 		break;
 	case EVLIST_SIGNAL:
-		TAILQ_REMOVE(&signalqueue, ev, ev_signal_next);
+		TAILQ_REMOVE(&base->signalqueue, ev, ev_signal_next);
 		break;
 	case EVLIST_TIMEOUT:
-		RB_REMOVE(event_tree, &timetree, ev);
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    base->common_timeout_queues[
+				    COMMON_TIMEOUT_IDX(&ev->ev_timeout)];
+
+			TAILQ_REMOVE(&ctl->events, ev,
+			    ev_timeout_pos.list.ev_timeout_next);
+		} else if (base->timewheel != NULL)
+			timewheel_remove(base->timewheel, ev);
+		else
+			min_heap_erase(&base->timeheap, ev);
 		break;
 	case EVLIST_INSERTED:
-		TAILQ_REMOVE(&eventqueue, ev, ev_next);
+		TAILQ_REMOVE(&base->eventqueue, ev, ev_next);
 		break;
 	default:
 		errx(1, "%s: unknown queue %x", __func__, queue);
 	}
 }
 
-void
-event_queue_insert(struct event *ev, int queue)
+static void
+event_queue_insert(struct event_base *base, struct event *ev, int queue)
 {
 	if (ev->ev_flags & queue)
 		errx(1, "%s: %p(fd %d) already on queue %x", __func__,
 		    ev, ev->ev_fd, queue);
 	//非内部事件都加加
 	if (!(ev->ev_flags & EVLIST_INTERNAL))
-		event_count++;
+		base->event_count++;
 
 	ev->ev_flags |= queue;
 	switch (queue) {
 	case EVLIST_ACTIVE:
-		TAILQ_INSERT_TAIL(&activequeue, ev, ev_active_next);
+		/* the number of priorities may have shrunk since event_set */
+		if (ev->ev_pri >= base->nactivequeues)
+			ev->ev_pri = base->nactivequeues - 1;
+		base->event_count_active++;
+		TAILQ_INSERT_TAIL(&base->activequeues[ev->ev_pri],
+		    ev, ev_active_next);
 		break;
 	case EVLIST_SIGNAL:
-		TAILQ_INSERT_TAIL(&signalqueue, ev, ev_signal_next);
+		TAILQ_INSERT_TAIL(&base->signalqueue, ev, ev_signal_next);
 		break;
-	case EVLIST_TIMEOUT: {
-		struct event *tmp = RB_INSERT(event_tree, &timetree, ev);
-		assert(tmp == NULL);
+	case EVLIST_TIMEOUT:
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    base->common_timeout_queues[
+				    COMMON_TIMEOUT_IDX(&ev->ev_timeout)];
+
+			common_timeout_insert(ctl, ev);
+		} else if (base->timewheel != NULL)
+			timewheel_insert(base->timewheel, ev);
+		else	/* space was reserved by event_add */
+			min_heap_push(&base->timeheap, ev);
 		break;
-	}
 	case EVLIST_INSERTED:
-		TAILQ_INSERT_TAIL(&eventqueue, ev, ev_next);
+		TAILQ_INSERT_TAIL(&base->eventqueue, ev, ev_next);
 		break;
 	default:
 		errx(1, "%s: unknown queue %x", __func__, queue);
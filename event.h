@@ -50,6 +50,8 @@ extern "C" {
 #define EV_WRITE	0x04
 #define EV_SIGNAL	0x08
 #define EV_PERSIST	0x10	/* Persistant event */
+#define EV_ET		0x20	/* Edge triggered, if the backend supports it */
+#define EV_COMPLETION	0x40	/* the backend reads into or writes from ev_buffer */
 
 /* Fix so that ppl dont have to run with <sys/queue.h> */
 #ifndef TAILQ_ENTRY
@@ -60,17 +62,9 @@ struct {								\
 	struct type **tqe_prev;	/* address of previous next element */	\
 }
 #endif /* !TAILQ_ENTRY */
-#ifndef RB_ENTRY
-#define _EVENT_DEFINED_RBENTRY
-#define RB_ENTRY(type)							\
-struct {								\
-	struct type *rbe_left;		/* left element */		\
-	struct type *rbe_right;		/* right element */		\
-	struct type *rbe_parent;	/* parent element */		\
-	int rbe_color;			/* node color */		\
-}
-#endif /* !RB_ENTRY */
 
+struct event_base;
+struct evbuffer;
 struct event {
 	/*
 	定义的队列元素，通过这些结构体串了起来。
@@ -79,8 +73,15 @@ struct event {
 	TAILQ_ENTRY (event) ev_next;
 	TAILQ_ENTRY (event) ev_active_next;//一种相当巧妙的设计？感觉有点意识？比之其他代码好像有点意识的感觉
 	TAILQ_ENTRY (event) ev_signal_next;
-	RB_ENTRY (event) ev_timeout_node;
-
+	union {
+		struct {
+			TAILQ_ENTRY (event) ev_timeout_next;
+			unsigned int ev_timeout_slot;
+		} list;			/* timing wheel slot */
+		unsigned int min_heap_idx;	/* position in the timeout heap */
+	} ev_timeout_pos;
+
+	struct event_base *ev_base;	/* loop this event belongs to */
 #ifdef WIN32
 	HANDLE ev_fd;
 	OVERLAPPED overlap;
@@ -91,14 +92,22 @@ struct event {
 	short ev_ncalls;
 	/* 该值指向ev_ncalls的地址。这样设计感觉有点奇怪啊。 */
 	short *ev_pncalls;	/* Allows deletes in callback */
+	int ev_pri;		/* smaller numbers are higher priority */
 
 	struct timeval ev_timeout;//时间的处理时间。根据传进来的超时时间，在内部重新计算一遍。
+	struct timeval ev_period;	/* interval of EV_PERSIST timers */
 
 	void (*ev_callback)(int, short, void *arg);
 	void *ev_arg;
 	/* 标志事件结果。写事件还是读事件，超时事件*/
 	//标志着是什么事件发生，信号还是超时等等。
 	int ev_res;		/* result passed to event callback */
+
+	/* Only used by EV_COMPLETION events */
+	struct evbuffer *ev_buffer;	/* data is received or sent here */
+	int ev_iobytes;		/* bytes moved since the callback ran */
+	int ev_ioerror;		/* errno of a failed operation, -1 at EOF */
+
 	int ev_flags; //标志是哪个队列，活动队列，信号队列
 };
 
@@ -117,33 +126,54 @@ struct event {
 */
 TAILQ_HEAD (event_list, event);
 #endif /* _EVENT_DEFINED_TQENTRY */
-#ifdef _EVENT_DEFINED_RBENTRY
-#undef RB_ENTRY
-#undef _EVENT_DEFINED_RBENTRY
-#endif /* _EVENT_DEFINED_RBENTRY */
 
 struct eventop {
 	char *name;
-	void *(*init)(void);// void * 是返回值
+	void *(*init)(struct event_base *);// void * 是返回值
 	int (*add)(void *, struct event *);
 	int (*del)(void *, struct event *);
-	int (*recalc)(void *, int);
-	int (*dispatch)(void *, struct timeval *);
+	int (*recalc)(struct event_base *, void *, int);
+	int (*dispatch)(struct event_base *, void *, struct timeval *);
+	void (*dealloc)(struct event_base *, void *);
+	int features;
+	/* Prepares EV_COMPLETION support, NULL if there is none */
+	int (*completion)(void *);
 };
 
+/* Backend capabilities in eventop.features */
+#define EV_FEATURE_THREADS	0x01	/* dispatch drops the base lock */
+#define EV_FEATURE_ET		0x02	/* supports EV_ET */
+
 #define TIMEOUT_DEFAULT	{5, 0}
 
-void event_init(void);
+struct event_base *event_init(void);
+struct event_base *event_base_new(void);
+const char *event_base_get_method(struct event_base *);
+void event_base_free(struct event_base *);
 int event_dispatch(void);
+int event_base_dispatch(struct event_base *);
 
 #define EVLOOP_ONCE	0x01
 #define EVLOOP_NONBLOCK	0x02
 int event_loop(int);
+int event_base_loop(struct event_base *, int);
 int event_loopexit(struct timeval *);	/* Causes the loop to exit */
-
-int timeout_next(struct timeval *);
-void timeout_correct(struct timeval *);
-void timeout_process(void);
+int event_base_loopexit(struct event_base *, struct timeval *);
+int event_priority_init(int);
+int event_base_priority_init(struct event_base *, int);
+int event_priority_set(struct event *, int);
+int event_base_enable_threads(struct event_base *);
+int event_base_post(struct event_base *, void (*)(void *), void *);
+void event_base_thread_stats(struct event_base *, unsigned long *);
+int event_base_gettimeofday_cached(struct event_base *, struct timeval *);
+void event_base_set_cache_time(struct event_base *, int);
+int event_base_timewheel_init(struct event_base *, struct timeval *);
+int event_base_set_timer_slack(struct event_base *, struct timeval *);
+int event_base_set_busy_poll(struct event_base *, struct timeval *);
+void event_base_busy_poll_stats(struct event_base *, unsigned long *,
+    unsigned long *);
+struct timeval *event_base_init_common_timeout(struct event_base *,
+    struct timeval *);
 
 #define evtimer_add(ev, tv)		event_add(ev, tv)
 #define evtimer_set(ev, cb, arg)	event_set(ev, -1, 0, cb, arg)
@@ -165,7 +195,10 @@ void timeout_process(void);
 #define signal_initialized(ev)		((ev)->ev_flags & EVLIST_INIT)
 
 void event_set(struct event *, int, short, void (*)(int, short, void *), void *);
+int event_base_set(struct event_base *, struct event *);
 int event_once(int, short, void (*)(int, short, void *), void *, struct timeval *);
+int event_base_once(struct event_base *, int, short,
+    void (*)(int, short, void *), void *, struct timeval *);
 
 int event_add(struct event *, struct timeval *);
 int event_del(struct event *);
@@ -241,6 +274,7 @@ struct bufferevent {
 struct bufferevent *bufferevent_new(int fd,
     evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void *cbarg);
 void bufferevent_free(struct bufferevent *bufev);
+int bufferevent_base_set(struct event_base *base, struct bufferevent *bufev);
 int bufferevent_write(struct bufferevent *bufev, void *data, size_t size);
 int bufferevent_write_buffer(struct bufferevent *bufev, struct evbuffer *buf);
 size_t bufferevent_read(struct bufferevent *bufev, void *data, size_t size);
@@ -248,6 +282,7 @@ int bufferevent_enable(struct bufferevent *bufev, short event);
 int bufferevent_disable(struct bufferevent *bufev, short event);
 void bufferevent_settimeout(struct bufferevent *bufev,
     int timeout_read, int timeout_write);
+int bufferevent_use_completion(struct bufferevent *bufev);
 
 #define EVBUFFER_LENGTH(x)	(x)->off
 #define EVBUFFER_DATA(x)	(x)->buffer
@@ -27,11 +27,30 @@
 #ifndef _EVSIGNAL_H_
 #define _EVSIGNAL_H_
 
-void evsignal_init(sigset_t *);
-void evsignal_process(void);
-int evsignal_recalc(sigset_t *);
-int evsignal_deliver(sigset_t *);
-int evsignal_add(sigset_t *, struct event *);
-int evsignal_del(sigset_t *, struct event *);
+struct event_base;
+
+struct evsignal_info {
+	struct event ev_signal;		/* reads from the signal socketpair */
+	int ev_signal_pair[2];
+	int ev_signal_added;
+	int needrecalc;
+	volatile sig_atomic_t evsignal_caught;
+	sig_atomic_t evsigcaught[NSIG];
+	sigset_t evsigmask;
+	int ev_signal_fd;		/* signalfd replacing the socketpair, or -1 */
+	sigset_t evsigblocked;		/* blocked by the loop */
+	sigset_t evsigwaitmask;		/* loop mask with evsigmask unblocked */
+	int evsigunblocked;		/* evsignal_deliver unblocked evsigmask */
+};
+
+void evsignal_init(struct event_base *);
+void evsignal_dealloc(struct event_base *);
+void evsignal_enable_threads(struct event_base *);
+void evsignal_process(struct event_base *);
+int evsignal_recalc(struct event_base *);
+int evsignal_deliver(struct event_base *);
+const sigset_t *evsignal_waitmask(struct event_base *);
+int evsignal_add(struct event *);
+int evsignal_del(struct event *);
 
 #endif /* _EVSIGNAL_H_ */
@@ -0,0 +1,1015 @@
+/*
+ * Copyright 2000-2003 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_time.h>
+#endif
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#ifdef USE_LOG
+#include "log.h"
+#else
+#define LOG_DBG(x)
+#define log_error	warn
+#endif
+
+#include "event.h"
+#include "event-internal.h"
+#include "evsignal.h"
+
+/*
+ * Every fd with interest has one poll request in the ring.  Its user data
+ * carries the fd and a generation, so that completions of requests that
+ * were replaced in the meantime can be told apart and dropped.
+ *
+ * EV_COMPLETION events do not poll: a multishot recv request fills the
+ * input buffer of the read event, and a send request drains the buffer
+ * of the write event.  They carry their own generations.
+ */
+struct eviouring {
+	struct event *evread;
+	struct event *evwrite;
+
+	unsigned int gen;	/* generation of the current request */
+	short kevents;		/* poll mask of the armed request, or 0 */
+	int kmulti;		/* the armed request is multishot */
+	int changed;		/* fd is on the changelist */
+	int dropped;		/* all interest was deleted since the wait */
+
+	struct event *evrecv;	/* EV_COMPLETION read event */
+	struct event *evsend;	/* EV_COMPLETION write event */
+	unsigned int recvgen;
+	unsigned int sendgen;
+	int recving;		/* the recv request is in the ring */
+	int sending;		/* the send request is in the ring */
+};
+
+struct iouringop {
+	struct eviouring *fds;
+	int nfds;
+	int *changes;		/* fds whose interest changed since the wait */
+	int nchanges;
+	int achanges;
+
+	int ringfd;
+	int skip_remove;	/* removals complete without a cqe */
+	void *ring;		/* the shared submission and completion rings */
+	size_t ringsz;
+	struct io_uring_sqe *sqes;
+	size_t sqesz;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	int completion;		/* 1 if EV_COMPLETION works, -1 if it does not */
+	int activated;		/* events were activated before the wait */
+	struct io_uring_buf_ring *br;	/* buffers provided for recv */
+	size_t brsz;
+	unsigned short brtail;
+	u_char *bufs;
+};
+
+void *iouring_init	(struct event_base *);
+int iouring_add		(void *, struct event *);
+int iouring_del		(void *, struct event *);
+int iouring_recalc	(struct event_base *, void *, int);
+int iouring_dispatch	(struct event_base *, void *, struct timeval *);
+void iouring_dealloc	(struct event_base *, void *);
+int iouring_completion	(void *);
+
+static int iouring_change(struct iouringop *, int);
+static void iouring_apply_changes(struct iouringop *);
+
+const struct eventop iouringops = {
+	"io_uring",
+	iouring_init,
+	iouring_add,
+	iouring_del,
+	iouring_recalc,
+	iouring_dispatch,
+	iouring_dealloc,
+	EV_FEATURE_THREADS|EV_FEATURE_ET,
+	iouring_completion
+};
+
+#define SQ_ENTRIES	256
+#define CQ_ENTRIES	4096
+#define INITIAL_NFILES	32
+
+#define NBUFS		64	/* buffers provided for recv, a power of 2 */
+#define BUFSZ		4096
+#define BGID		0
+
+/*
+ * User data: the top two bits tell what kind of request completed, the
+ * generation takes the rest of the upper half and the fd the lower half.
+ */
+#define IOURING_POLL	0
+#define IOURING_RECV	1
+#define IOURING_SEND	2
+#define IOURING_GENMASK	0x3fffffff
+
+#define IOURING_REMOVE	((u_int64_t)-1)	/* user data of cancellations */
+#define IOURING_KEY(kind, fd, gen)	((u_int64_t)((unsigned int)(kind) << 30 | \
+	((gen) & IOURING_GENMASK)) << 32 | (unsigned int)(fd))
+#define IOURING_KIND(key)	((int)((key) >> 62))
+#define IOURING_GEN(key)	((unsigned int)((key) >> 32) & IOURING_GENMASK)
+#define IOURING_FD(key)		((int)((key) & 0xffffffff))
+
+/* Flags of two events that cannot share one poll request */
+#define IOURING_MISMATCH(a, b)	((((a) ^ (b)) & EV_ET) || \
+	(((a) & EV_ET) && (((a) ^ (b)) & EV_PERSIST)))
+
+static __inline int
+io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static __inline int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+    unsigned int flags, void *arg, size_t argsz)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		    flags, arg, argsz));
+}
+
+static __inline int
+io_uring_register(int fd, unsigned int opcode, void *arg,
+    unsigned int nr_args)
+{
+	return (syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+void *
+iouring_init(struct event_base *base)
+{
+	struct iouringop *iop;
+	struct io_uring_params p;
+	unsigned int i, *sq_array;
+	size_t sqsz, cqsz;
+
+	/* Disable io_uring when this environment variable is set */
+	if (getenv("EVENT_NOIOURING"))
+		return (NULL);
+
+	if (!(iop = calloc(1, sizeof(struct iouringop))))
+		return (NULL);
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = CQ_ENTRIES;
+	if ((iop->ringfd = io_uring_setup(SQ_ENTRIES, &p)) == -1) {
+		free(iop);
+		return (NULL);
+	}
+
+	/* We need the timeout argument to io_uring_enter and no lost events */
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NODROP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		close(iop->ringfd);
+		free(iop);
+		return (NULL);
+	}
+
+#ifdef IORING_FEAT_CQE_SKIP
+	iop->skip_remove = (p.features & IORING_FEAT_CQE_SKIP) != 0;
+#endif
+
+	sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	iop->ringsz = sqsz > cqsz ? sqsz : cqsz;
+	iop->ring = mmap(NULL, iop->ringsz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, iop->ringfd, IORING_OFF_SQ_RING);
+	if (iop->ring == MAP_FAILED) {
+		log_error("mmap");
+		close(iop->ringfd);
+		free(iop);
+		return (NULL);
+	}
+
+	iop->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+	iop->sqes = mmap(NULL, iop->sqesz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, iop->ringfd, IORING_OFF_SQES);
+	if (iop->sqes == MAP_FAILED) {
+		log_error("mmap");
+		munmap(iop->ring, iop->ringsz);
+		close(iop->ringfd);
+		free(iop);
+		return (NULL);
+	}
+
+	iop->sq_head = (unsigned int *)((char *)iop->ring + p.sq_off.head);
+	iop->sq_tail = (unsigned int *)((char *)iop->ring + p.sq_off.tail);
+	iop->sq_mask = *(unsigned int *)((char *)iop->ring + p.sq_off.ring_mask);
+	iop->sq_entries = p.sq_entries;
+	iop->cq_head = (unsigned int *)((char *)iop->ring + p.cq_off.head);
+	iop->cq_tail = (unsigned int *)((char *)iop->ring + p.cq_off.tail);
+	iop->cq_mask = *(unsigned int *)((char *)iop->ring + p.cq_off.ring_mask);
+	iop->cqes = (struct io_uring_cqe *)((char *)iop->ring + p.cq_off.cqes);
+
+	/* Slot i of the submission queue always holds sqe i */
+	sq_array = (unsigned int *)((char *)iop->ring + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	iop->fds = calloc(INITIAL_NFILES, sizeof(struct eviouring));
+	if (iop->fds == NULL) {
+		munmap(iop->sqes, iop->sqesz);
+		munmap(iop->ring, iop->ringsz);
+		close(iop->ringfd);
+		free(iop);
+		return (NULL);
+	}
+	iop->nfds = INITIAL_NFILES;
+
+	evsignal_init(base);
+
+	return (iop);
+}
+
+static int
+iouring_grow(struct iouringop *iop, int max)
+{
+	if (max > iop->nfds) {
+		struct eviouring *fds;
+		int nfds;
+
+		nfds = iop->nfds;
+		while (nfds < max)
+			nfds <<= 1;
+
+		fds = realloc(iop->fds, nfds * sizeof(struct eviouring));
+		if (fds == NULL) {
+			log_error("realloc");
+			return (-1);
+		}
+		iop->fds = fds;
+		memset(fds + iop->nfds, 0,
+		    (nfds - iop->nfds) * sizeof(struct eviouring));
+		iop->nfds = nfds;
+	}
+
+	return (0);
+}
+
+int
+iouring_recalc(struct event_base *base, void *arg, int max)
+{
+	struct iouringop *iop = arg;
+
+	if (iouring_grow(iop, max) == -1)
+		return (-1);
+
+	return (evsignal_recalc(base));
+}
+
+/* Number of queued entries the kernel has not consumed yet */
+static __inline unsigned int
+iouring_pending(struct iouringop *iop)
+{
+	__sync_synchronize();
+	return (*iop->sq_tail - *(volatile unsigned int *)iop->sq_head);
+}
+
+/*
+ * Returns the next free submission entry.  When the queue is full, the
+ * entries so far are handed to the kernel without waiting.
+ */
+static struct io_uring_sqe *
+iouring_get_sqe(struct iouringop *iop)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *iop->sq_tail;
+
+	if (iouring_pending(iop) == iop->sq_entries) {
+		if (io_uring_enter(iop->ringfd, iop->sq_entries, 0, 0,
+			NULL, 0) == -1) {
+			log_error("io_uring_enter");
+			return (NULL);
+		}
+		if (iouring_pending(iop) == iop->sq_entries)
+			return (NULL);
+	}
+
+	sqe = &iop->sqes[tail & iop->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return (sqe);
+}
+
+/* Makes the entry returned by iouring_get_sqe visible to the kernel */
+static __inline void
+iouring_push_sqe(struct iouringop *iop)
+{
+	__sync_synchronize();
+	*iop->sq_tail = *iop->sq_tail + 1;
+	__sync_synchronize();
+}
+
+/*
+ * Remembers that the interest in fd changed.  The requests are only
+ * queued right before we wait, and they are submitted by the same
+ * io_uring_enter that waits for completions.
+ */
+static int
+iouring_change(struct iouringop *iop, int fd)
+{
+	struct eviouring *evio = &iop->fds[fd];
+
+	if (evio->changed)
+		return (0);
+
+	if (iop->nchanges == iop->achanges) {
+		int *changes, n = iop->achanges ? iop->achanges * 2 : 64;
+
+		if ((changes = realloc(iop->changes, n * sizeof(int))) == NULL) {
+			log_error("realloc");
+			return (-1);
+		}
+		iop->changes = changes;
+		iop->achanges = n;
+	}
+
+	iop->changes[iop->nchanges++] = fd;
+	evio->changed = 1;
+
+	return (0);
+}
+
+/* Queues the poll request that matches the interest in fd */
+static int
+iouring_apply_poll(struct iouringop *iop, int fd, struct eviouring *evio)
+{
+	struct io_uring_sqe *sqe;
+	short events;
+	int multi;
+
+	events = 0;
+	if (evio->evread != NULL)
+		events |= POLLIN;
+	if (evio->evwrite != NULL)
+		events |= POLLOUT;
+
+	/*
+	 * Multishot polls only report new wakeups, that is they are
+	 * edge triggered.  Level triggered events get a single shot
+	 * request that is rearmed after their callbacks ran.
+	 */
+	multi = events != 0 &&
+	    (evio->evread == NULL || (evio->evread->ev_events &
+		(EV_ET|EV_PERSIST)) == (EV_ET|EV_PERSIST)) &&
+	    (evio->evwrite == NULL || (evio->evwrite->ev_events &
+		(EV_ET|EV_PERSIST)) == (EV_ET|EV_PERSIST));
+
+	/*
+	 * After all interest was deleted, the fd may have been closed
+	 * and reused.  A request keeps polling the file it was made
+	 * for, so it has to be replaced even if it looks right.
+	 */
+	if (!evio->dropped && events == evio->kevents &&
+	    multi == evio->kmulti)
+		return (0);
+
+	if (evio->kevents) {
+		if ((sqe = iouring_get_sqe(iop)) == NULL)
+			return (-1);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = IOURING_KEY(IOURING_POLL, fd, evio->gen);
+		sqe->user_data = IOURING_REMOVE;
+#ifdef IORING_FEAT_CQE_SKIP
+		if (iop->skip_remove)
+			sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+#endif
+		iouring_push_sqe(iop);
+		evio->kevents = 0;
+	}
+
+	if (events) {
+		if ((sqe = iouring_get_sqe(iop)) == NULL)
+			return (-1);
+		evio->gen = (evio->gen + 1) & IOURING_GENMASK;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		/* The kernel swaps the halves of the 32 bit mask */
+		sqe->poll32_events = (unsigned int)events << 16;
+#else
+		sqe->poll32_events = events;
+#endif
+		if (multi)
+			sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = IOURING_KEY(IOURING_POLL, fd, evio->gen);
+		iouring_push_sqe(iop);
+		evio->kevents = events;
+		evio->kmulti = multi;
+	}
+
+	evio->dropped = 0;
+
+	return (0);
+}
+
+#ifdef IORING_RECV_MULTISHOT
+/* Hands buffer bid back to the kernel for the next recv */
+static void
+iouring_put_buf(struct iouringop *iop, int bid)
+{
+	struct io_uring_buf *buf;
+
+	/* The tail overlays the resv field of the first entry, keep off it */
+	buf = &iop->br->bufs[iop->brtail & (NBUFS - 1)];
+	buf->addr = (u_int64_t)(uintptr_t)(iop->bufs + bid * BUFSZ);
+	buf->len = BUFSZ;
+	buf->bid = bid;
+	iop->brtail++;
+
+	__sync_synchronize();
+	*(volatile unsigned short *)&iop->br->tail = iop->brtail;
+}
+
+/*
+ * Accounts a completed recv or send to its event.  When the event is
+ * being deleted, the data is kept but nothing is activated or rearmed.
+ */
+static void
+iouring_io_done(struct iouringop *iop, int fd, struct eviouring *evio,
+    int kind, struct io_uring_cqe *cqe, int deleting)
+{
+	struct event *ev;
+	int res = cqe->res;
+
+	if (kind == IOURING_RECV) {
+		ev = evio->evrecv;
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			evio->recving = 0;
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if (res > 0 && ev != NULL &&
+			    evbuffer_add(ev->ev_buffer,
+				iop->bufs + bid * BUFSZ, res) == -1)
+				res = -ENOMEM;
+			iouring_put_buf(iop, bid);
+		}
+	} else {
+		ev = evio->evsend;
+		evio->sending = 0;
+		if (res > 0 && ev != NULL)
+			evbuffer_drain(ev->ev_buffer, res);
+	}
+
+	if (ev == NULL)
+		return;
+
+	if (res > 0)
+		ev->ev_iobytes += res;
+	else if (res == 0 && kind == IOURING_RECV)
+		ev->ev_ioerror = -1;
+	else if (res < 0 && res != -ECANCELED && res != -ENOBUFS)
+		ev->ev_ioerror = -res;
+
+	if (deleting)
+		return;
+
+	if (kind == IOURING_RECV) {
+		/* Ran out of buffers or was stopped, start over */
+		if (!evio->recving && !ev->ev_ioerror)
+			iouring_change(iop, fd);
+		if (ev->ev_iobytes || ev->ev_ioerror)
+			event_active(ev, EV_READ, 1);
+	} else {
+		if (ev->ev_events & EV_PERSIST)
+			iouring_change(iop, fd);
+		else
+			event_del(ev);
+		event_active(ev, EV_WRITE, 1);
+	}
+}
+
+/*
+ * Stops the recv or send request of fd.  Once the cancellation returns,
+ * all completions of the request are in the ring.  Those that were not
+ * reaped yet are accounted now and marked so that dispatch skips them.
+ */
+static void
+iouring_cancel(struct iouringop *iop, int fd, struct eviouring *evio,
+    int kind)
+{
+	struct io_uring_sync_cancel_reg reg;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	u_int64_t key;
+
+	key = IOURING_KEY(kind, fd,
+	    kind == IOURING_RECV ? evio->recvgen : evio->sendgen);
+
+	/* The request may still sit in the submission queue */
+	if (iouring_pending(iop) &&
+	    io_uring_enter(iop->ringfd, iouring_pending(iop), 0, 0,
+		NULL, 0) == -1)
+		log_error("io_uring_enter");
+
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = key;
+	reg.fd = -1;
+	reg.timeout.tv_sec = -1;
+	reg.timeout.tv_nsec = -1;
+	if (io_uring_register(iop->ringfd, IORING_REGISTER_SYNC_CANCEL,
+		&reg, 1) == -1 && errno != ENOENT)
+		log_error("IORING_REGISTER_SYNC_CANCEL");
+
+	/* Moves completions that did not fit into the ring over */
+	if (io_uring_enter(iop->ringfd, 0, 0, IORING_ENTER_GETEVENTS,
+		NULL, 0) == -1)
+		log_error("io_uring_enter");
+
+	__sync_synchronize();
+	head = *iop->cq_head;
+	tail = *(volatile unsigned int *)iop->cq_tail;
+	__sync_synchronize();
+
+	for (; head != tail; head++) {
+		cqe = &iop->cqes[head & iop->cq_mask];
+		if (cqe->user_data != key)
+			continue;
+		iouring_io_done(iop, fd, evio, kind, cqe, 1);
+		cqe->user_data = IOURING_REMOVE;
+	}
+
+	if (kind == IOURING_RECV)
+		evio->recving = 0;
+	else
+		evio->sending = 0;
+}
+
+/*
+ * Registers the buffers that multishot recv requests pick from, and
+ * checks that requests can be cancelled synchronously.
+ */
+int
+iouring_completion(void *arg)
+{
+	struct iouringop *iop = arg;
+	struct io_uring_sync_cancel_reg cancel;
+	struct io_uring_buf_reg reg;
+	int i;
+
+	if (iop->completion)
+		return (iop->completion == 1 ? 0 : -1);
+	iop->completion = -1;
+
+	/* Nothing matches, but old kernels do not know the opcode */
+	memset(&cancel, 0, sizeof(cancel));
+	cancel.addr = IOURING_REMOVE;
+	cancel.fd = -1;
+	cancel.timeout.tv_sec = -1;
+	cancel.timeout.tv_nsec = -1;
+	if (io_uring_register(iop->ringfd, IORING_REGISTER_SYNC_CANCEL,
+		&cancel, 1) == -1 && errno != ENOENT)
+		return (-1);
+
+	iop->brsz = NBUFS * sizeof(struct io_uring_buf);
+	iop->br = mmap(NULL, iop->brsz, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (iop->br == MAP_FAILED) {
+		iop->br = NULL;
+		return (-1);
+	}
+	if ((iop->bufs = malloc(NBUFS * BUFSZ)) == NULL) {
+		munmap(iop->br, iop->brsz);
+		iop->br = NULL;
+		return (-1);
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u_int64_t)(uintptr_t)iop->br;
+	reg.ring_entries = NBUFS;
+	reg.bgid = BGID;
+	if (io_uring_register(iop->ringfd, IORING_REGISTER_PBUF_RING,
+		&reg, 1) == -1) {
+		free(iop->bufs);
+		munmap(iop->br, iop->brsz);
+		iop->bufs = NULL;
+		iop->br = NULL;
+		return (-1);
+	}
+
+	for (i = 0; i < NBUFS; i++)
+		iouring_put_buf(iop, i);
+
+	iop->completion = 1;
+	return (0);
+}
+
+/* Queues the recv and send requests of EV_COMPLETION events on fd */
+static int
+iouring_apply_io(struct iouringop *iop, int fd, struct eviouring *evio)
+{
+	struct io_uring_sqe *sqe;
+	struct event *ev;
+
+	/* A recv that failed stays down until the error was reported */
+	ev = evio->evrecv;
+	if (ev != NULL && !evio->recving && !ev->ev_ioerror) {
+		if ((sqe = iouring_get_sqe(iop)) == NULL)
+			return (-1);
+		evio->recvgen = (evio->recvgen + 1) & IOURING_GENMASK;
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BGID;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->user_data = IOURING_KEY(IOURING_RECV, fd, evio->recvgen);
+		iouring_push_sqe(iop);
+		evio->recving = 1;
+	}
+
+	ev = evio->evsend;
+	if (ev != NULL && !evio->sending) {
+		if (EVBUFFER_LENGTH(ev->ev_buffer) == 0) {
+			/* Nothing to send, the write is done right away */
+			if (!(ev->ev_events & EV_PERSIST))
+				event_del(ev);
+			event_active(ev, EV_WRITE, 1);
+			iop->activated = 1;
+			return (0);
+		}
+
+		/* The buffer must not move until the send completed */
+		if ((sqe = iouring_get_sqe(iop)) == NULL)
+			return (-1);
+		evio->sendgen = (evio->sendgen + 1) & IOURING_GENMASK;
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = fd;
+		sqe->addr = (u_int64_t)(uintptr_t)EVBUFFER_DATA(ev->ev_buffer);
+		sqe->len = EVBUFFER_LENGTH(ev->ev_buffer);
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = IOURING_KEY(IOURING_SEND, fd, evio->sendgen);
+		iouring_push_sqe(iop);
+		evio->sending = 1;
+	}
+
+	return (0);
+}
+
+#else
+#define iouring_put_buf(iop, bid)
+#define iouring_io_done(iop, fd, evio, kind, cqe, deleting)
+#define iouring_cancel(iop, fd, evio, kind)
+#define iouring_apply_io(iop, fd, evio)	(0)
+
+int
+iouring_completion(void *arg)
+{
+	return (-1);
+}
+#endif /* IORING_RECV_MULTISHOT */
+
+/* Queues the requests that bring every changed fd up to date */
+static void
+iouring_apply_changes(struct iouringop *iop)
+{
+	struct eviouring *evio;
+	int i, fd;
+
+	for (i = 0; i < iop->nchanges; i++) {
+		fd = iop->changes[i];
+		evio = &iop->fds[fd];
+
+		if (iouring_apply_poll(iop, fd, evio) == -1)
+			break;
+		if (iouring_apply_io(iop, fd, evio) == -1)
+			break;
+
+		evio->changed = 0;
+	}
+
+	/* Whatever did not fit into the ring is tried again next time */
+	if (i < iop->nchanges) {
+		log_error("io_uring submission queue");
+		memmove(iop->changes, iop->changes + i,
+		    (iop->nchanges - i) * sizeof(int));
+	}
+	iop->nchanges -= i;
+}
+
+int
+iouring_dispatch(struct event_base *base, void *arg, struct timeval *tv)
+{
+	struct iouringop *iop = arg;
+	struct io_uring_getevents_arg getevents;
+	struct __kernel_timespec ts;
+	const sigset_t *sigmask;
+	struct io_uring_cqe *cqe;
+	struct eviouring *evio;
+	unsigned int head, tail;
+	int res, fd, kind, what;
+
+	iop->activated = 0;
+	iouring_apply_changes(iop);
+
+	/* Do not sleep on events that are already done */
+	if (iop->activated)
+		timerclear(tv);
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+	memset(&getevents, 0, sizeof(getevents));
+	getevents.ts = (u_int64_t)(uintptr_t)&ts;
+	/* Unblocks the signals only for the duration of the wait */
+	if ((sigmask = evsignal_waitmask(base)) != NULL) {
+		getevents.sigmask = (u_int64_t)(uintptr_t)sigmask;
+		getevents.sigmask_sz = _NSIG / 8;
+	}
+
+	/* Submits the queued requests and waits in one system call */
+	EVBASE_RELEASE_LOCK(base);
+	res = io_uring_enter(iop->ringfd, iouring_pending(iop), 1,
+	    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+	    &getevents, sizeof(getevents));
+	EVBASE_ACQUIRE_LOCK(base);
+
+	if (evsignal_recalc(base) == -1)
+		return (-1);
+
+	if (res == -1) {
+		if (errno == EINTR) {
+			evsignal_process(base);
+			return (0);
+		}
+		if (errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+			log_error("io_uring_enter");
+			return (-1);
+		}
+	} else if (base->sig.evsignal_caught)
+		evsignal_process(base);
+
+	__sync_synchronize();
+	head = *iop->cq_head;
+	tail = *(volatile unsigned int *)iop->cq_tail;
+	__sync_synchronize();
+
+	LOG_DBG((LOG_MISC, 80, "%s: io_uring reports %d", __func__,
+		tail - head));
+
+	for (; head != tail; head++) {
+		int which = 0;
+		struct event *evread = NULL, *evwrite = NULL;
+
+		cqe = &iop->cqes[head & iop->cq_mask];
+		if (cqe->user_data == IOURING_REMOVE)
+			continue;
+
+		/* fds may have been reallocated by another thread */
+		fd = IOURING_FD(cqe->user_data);
+		if (fd >= iop->nfds)
+			continue;
+		evio = &iop->fds[fd];
+
+		kind = IOURING_KIND(cqe->user_data);
+		if (kind != IOURING_POLL) {
+			if (IOURING_GEN(cqe->user_data) == (kind == IOURING_RECV ?
+				evio->recvgen : evio->sendgen))
+				iouring_io_done(iop, fd, evio, kind, cqe, 0);
+			else if (cqe->flags & IORING_CQE_F_BUFFER)
+				iouring_put_buf(iop,
+				    cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			continue;
+		}
+
+		/* Completion of a request that was replaced since */
+		if (IOURING_GEN(cqe->user_data) != evio->gen)
+			continue;
+
+		if (cqe->res < 0 && cqe->res != -ECANCELED) {
+			/*
+			 * The fd is bad or was closed.  A new request would
+			 * fail the same way, so it is not rearmed; the events
+			 * are made active instead and their callbacks run
+			 * into the error when they do their I/O.
+			 */
+			errno = -cqe->res;
+			log_error("IORING_OP_POLL_ADD");
+			evio->kevents = 0;
+			evread = evio->evread;
+			evwrite = evio->evwrite;
+		} else {
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				/* The request is gone, rearm it if still wanted */
+				evio->kevents = 0;
+				if ((evio->evread != NULL ||
+					evio->evwrite != NULL) &&
+				    iouring_change(iop, fd) == -1)
+					break;
+			}
+
+			if (cqe->res < 0)
+				continue;
+
+			what = cqe->res;
+			if (what & (POLLHUP|POLLERR))
+				what |= POLLIN | POLLOUT;
+
+			if (what & POLLIN) {
+				evread = evio->evread;
+				which |= EV_READ;
+			}
+
+			if (what & POLLOUT) {
+				evwrite = evio->evwrite;
+				which |= EV_WRITE;
+			}
+
+			if (!which)
+				continue;
+		}
+
+		if (evread != NULL && !(evread->ev_events & EV_PERSIST))
+			event_del(evread);
+		if (evwrite != NULL && evwrite != evread &&
+		    !(evwrite->ev_events & EV_PERSIST))
+			event_del(evwrite);
+
+		if (evread != NULL)
+			event_active(evread, EV_READ, 1);
+		if (evwrite != NULL)
+			event_active(evwrite, EV_WRITE, 1);
+	}
+
+	__sync_synchronize();
+	*iop->cq_head = head;
+	__sync_synchronize();
+
+	return (0);
+}
+
+int
+iouring_add(void *arg, struct event *ev)
+{
+	struct iouringop *iop = arg;
+	struct eviouring *evio;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_add(ev));
+
+	fd = ev->ev_fd;
+	if (fd >= iop->nfds) {
+		/* Extent the file descriptor array as necessary */
+		if (iouring_grow(iop, fd + 1) == -1)
+			return (-1);
+	}
+	evio = &iop->fds[fd];
+
+	if (ev->ev_events & EV_COMPLETION) {
+		if (iop->completion != 1 || ev->ev_buffer == NULL ||
+		    (ev->ev_events & (EV_READ|EV_WRITE)) == (EV_READ|EV_WRITE))
+			return (-1);
+		if (iouring_change(iop, fd) == -1)
+			return (-1);
+
+		if (ev->ev_events & EV_READ) {
+			evio->evrecv = ev;
+			/* Report what arrived while the event was deleted */
+			if (ev->ev_iobytes || ev->ev_ioerror)
+				event_active(ev, EV_READ, 1);
+		} else
+			evio->evsend = ev;
+		return (0);
+	}
+
+	/*
+	 * One poll request serves both events, and only a multishot one
+	 * is edge triggered.  So they have to agree on EV_ET, and edge
+	 * triggered ones on EV_PERSIST as well.
+	 */
+	if ((evio->evread != NULL && evio->evread != ev &&
+		IOURING_MISMATCH(evio->evread->ev_events, ev->ev_events)) ||
+	    (evio->evwrite != NULL && evio->evwrite != ev &&
+		IOURING_MISMATCH(evio->evwrite->ev_events, ev->ev_events)))
+		return (-1);
+
+	if (iouring_change(iop, fd) == -1)
+		return (-1);
+
+	/* Update events responsible */
+	if (ev->ev_events & EV_READ)
+		evio->evread = ev;
+	if (ev->ev_events & EV_WRITE)
+		evio->evwrite = ev;
+
+	return (0);
+}
+
+int
+iouring_del(void *arg, struct event *ev)
+{
+	struct iouringop *iop = arg;
+	struct eviouring *evio;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_del(ev));
+
+	fd = ev->ev_fd;
+	if (fd >= iop->nfds)
+		return (0);
+	evio = &iop->fds[fd];
+
+	if (ev->ev_events & EV_COMPLETION) {
+		if (ev == evio->evrecv) {
+			if (evio->recving)
+				iouring_cancel(iop, fd, evio, IOURING_RECV);
+			evio->evrecv = NULL;
+		} else if (ev == evio->evsend) {
+			if (evio->sending)
+				iouring_cancel(iop, fd, evio, IOURING_SEND);
+			evio->evsend = NULL;
+		}
+		return (0);
+	}
+
+	if (iouring_change(iop, fd) == -1)
+		return (-1);
+
+	if (ev->ev_events & EV_READ)
+		evio->evread = NULL;
+	if (ev->ev_events & EV_WRITE)
+		evio->evwrite = NULL;
+	if (evio->evread == NULL && evio->evwrite == NULL)
+		evio->dropped = 1;
+
+	return (0);
+}
+
+void
+iouring_dealloc(struct event_base *base, void *arg)
+{
+	struct iouringop *iop = arg;
+
+	evsignal_dealloc(base);
+	if (iop->fds)
+		free(iop->fds);
+	if (iop->changes)
+		free(iop->changes);
+	/* Closing the ring cancels all outstanding requests */
+	munmap(iop->sqes, iop->sqesz);
+	munmap(iop->ring, iop->ringsz);
+	close(iop->ringfd);
+	if (iop->br != NULL) {
+		munmap(iop->br, iop->brsz);
+		free(iop->bufs);
+	}
+
+	free(iop);
+}
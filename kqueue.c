@@ -64,10 +64,6 @@
 
 #include "event.h"
 
-extern struct event_list timequeue;
-extern struct event_list eventqueue;
-extern struct event_list addqueue;
-
 #define EVLIST_X_KQINKERNEL	0x1000
 
 #define NEVENT		64
@@ -78,14 +74,15 @@ struct kqop {
 	struct kevent *events;//监控队列
 	int nevents;//申请到的队列总长度。命名的很差。
 	int kq;// kq队列
-} kqueueop;
+};
 
-void *kq_init	(void);
+void *kq_init	(struct event_base *);
 int kq_add	(void *, struct event *);
 int kq_del	(void *, struct event *);
-int kq_recalc	(void *, int);
-int kq_dispatch	(void *, struct timeval *);
+int kq_recalc	(struct event_base *, void *, int);
+int kq_dispatch	(struct event_base *, void *, struct timeval *);
 int kq_insert	(struct kqop *, struct kevent *);
+void kq_dealloc	(struct event_base *, void *);
 
 const struct eventop kqops = {
 	"kqueue",
@@ -93,45 +90,56 @@ const struct eventop kqops = {
 	kq_add,
 	kq_del,
 	kq_recalc,
-	kq_dispatch
+	kq_dispatch,
+	kq_dealloc,
+	EV_FEATURE_ET,
+	NULL
 };
 
 void *
-kq_init(void)
+kq_init(struct event_base *base)
 {
 	int kq;
+	struct kqop *kqueueop;
 
 	/* Disable kqueue when this environment variable is set */
 	if (getenv("EVENT_NOKQUEUE"))
 		return (NULL);
 
-	memset(&kqueueop, 0, sizeof(kqueueop));
+	if (!(kqueueop = calloc(1, sizeof(struct kqop))))
+		return (NULL);
 
 	/* Initalize the kernel queue */
 	
 	if ((kq = kqueue()) == -1) {
 		log_error("kqueue");
+		free(kqueueop);
 		return (NULL);
 	}
 
-	kqueueop.kq = kq;
+	kqueueop->kq = kq;
 
 	/* Initalize fields */
-	kqueueop.changes = malloc(NEVENT * sizeof(struct kevent));
-	if (kqueueop.changes == NULL)
+	kqueueop->changes = malloc(NEVENT * sizeof(struct kevent));
+	if (kqueueop->changes == NULL) {
+		close(kq);
+		free(kqueueop);
 		return (NULL);
-	kqueueop.events = malloc(NEVENT * sizeof(struct kevent));
-	if (kqueueop.events == NULL) {
-		free (kqueueop.changes);
+	}
+	kqueueop->events = malloc(NEVENT * sizeof(struct kevent));
+	if (kqueueop->events == NULL) {
+		free(kqueueop->changes);
+		close(kq);
+		free(kqueueop);
 		return (NULL);
 	}
-	kqueueop.nevents = NEVENT;
+	kqueueop->nevents = NEVENT;
 
-	return (&kqueueop);
+	return (kqueueop);
 }
 
 int
-kq_recalc(void *arg, int max)
+kq_recalc(struct event_base *base, void *arg, int max)
 {
 	return (0);
 }
@@ -189,7 +197,7 @@ kq_sighandler(int sig)
 }
 
 int
-kq_dispatch(void *arg, struct timeval *tv)
+kq_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
 	struct kqop *kqop = arg;
 	struct kevent *changes = kqop->changes;
@@ -307,6 +315,8 @@ kq_add(void *arg, struct event *ev)
 		kev.flags = EV_ADD;
 		if (!(ev->ev_events & EV_PERSIST))
 			kev.flags |= EV_ONESHOT;
+		if (ev->ev_events & EV_ET)
+			kev.flags |= EV_CLEAR;
 		kev.udata = INTPTR(ev);
 		
 		if (kq_insert(kqop, &kev) == -1)
@@ -322,6 +332,8 @@ kq_add(void *arg, struct event *ev)
 		kev.flags = EV_ADD;
 		if (!(ev->ev_events & EV_PERSIST))
 			kev.flags |= EV_ONESHOT;
+		if (ev->ev_events & EV_ET)
+			kev.flags |= EV_CLEAR;
 		kev.udata = INTPTR(ev);
 		
 		if (kq_insert(kqop, &kev) == -1)
@@ -386,3 +398,18 @@ kq_del(void *arg, struct event *ev)
 
 	return (0);
 }
+
+void
+kq_dealloc(struct event_base *base, void *arg)
+{
+	struct kqop *kqop = arg;
+
+	if (kqop->changes)
+		free(kqop->changes);
+	if (kqop->events)
+		free(kqop->events);
+	if (kqop->kq >= 0)
+		close(kqop->kq);
+
+	free(kqop);
+}
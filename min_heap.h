@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _MIN_HEAP_H_
+#define _MIN_HEAP_H_
+
+/*
+ * Array based binary heap of events ordered by ev_timeout.  Each event
+ * remembers its slot in min_heap_idx, which makes removal O(log n)
+ * without a search and lets the earliest timeout be read in O(1).
+ */
+struct min_heap {
+	struct event **p;
+	unsigned int n;		/* number of elements */
+	unsigned int a;		/* allocated slots */
+};
+
+#define MIN_HEAP_IDX_NONE	((unsigned int)-1)
+#define MIN_HEAP_IDX(e)		((e)->ev_timeout_pos.min_heap_idx)
+
+static __inline void
+min_heap_ctor(struct min_heap *s)
+{
+	s->p = NULL;
+	s->n = 0;
+	s->a = 0;
+}
+
+static __inline void
+min_heap_dtor(struct min_heap *s)
+{
+	if (s->p != NULL)
+		free(s->p);
+}
+
+static __inline void
+min_heap_elem_init(struct event *e)
+{
+	MIN_HEAP_IDX(e) = MIN_HEAP_IDX_NONE;
+}
+
+static __inline int
+min_heap_elem_greater(struct event *a, struct event *b)
+{
+	return (timercmp(&a->ev_timeout, &b->ev_timeout, >));
+}
+
+static __inline int
+min_heap_empty(struct min_heap *s)
+{
+	return (s->n == 0);
+}
+
+static __inline unsigned int
+min_heap_size(struct min_heap *s)
+{
+	return (s->n);
+}
+
+static __inline struct event *
+min_heap_top(struct min_heap *s)
+{
+	return (s->n ? *s->p : NULL);
+}
+
+static __inline int
+min_heap_reserve(struct min_heap *s, unsigned int n)
+{
+	if (s->a < n) {
+		struct event **p;
+		unsigned int a = s->a ? s->a * 2 : 8;
+
+		if (a < n)
+			a = n;
+		if ((p = realloc(s->p, a * sizeof(*p))) == NULL)
+			return (-1);
+		s->p = p;
+		s->a = a;
+	}
+	return (0);
+}
+
+static __inline void
+min_heap_shift_up_(struct min_heap *s, unsigned int hole_index,
+    struct event *e)
+{
+	unsigned int parent = (hole_index - 1) / 2;
+
+	while (hole_index && min_heap_elem_greater(s->p[parent], e)) {
+		MIN_HEAP_IDX(s->p[hole_index] = s->p[parent]) = hole_index;
+		hole_index = parent;
+		parent = (hole_index - 1) / 2;
+	}
+	MIN_HEAP_IDX(s->p[hole_index] = e) = hole_index;
+}
+
+static __inline void
+min_heap_shift_down_(struct min_heap *s, unsigned int hole_index,
+    struct event *e)
+{
+	unsigned int min_child = 2 * (hole_index + 1);
+
+	while (min_child <= s->n) {
+		if (min_child == s->n ||
+		    min_heap_elem_greater(s->p[min_child], s->p[min_child - 1]))
+			min_child--;
+		if (!min_heap_elem_greater(e, s->p[min_child]))
+			break;
+		MIN_HEAP_IDX(s->p[hole_index] = s->p[min_child]) = hole_index;
+		hole_index = min_child;
+		min_child = 2 * (hole_index + 1);
+	}
+	MIN_HEAP_IDX(s->p[hole_index] = e) = hole_index;
+}
+
+static __inline int
+min_heap_push(struct min_heap *s, struct event *e)
+{
+	if (min_heap_reserve(s, s->n + 1) == -1)
+		return (-1);
+	min_heap_shift_up_(s, s->n++, e);
+	return (0);
+}
+
+static __inline struct event *
+min_heap_pop(struct min_heap *s)
+{
+	struct event *e;
+
+	if (!s->n)
+		return (NULL);
+
+	e = *s->p;
+	min_heap_shift_down_(s, 0, s->p[--s->n]);
+	MIN_HEAP_IDX(e) = MIN_HEAP_IDX_NONE;
+	return (e);
+}
+
+static __inline int
+min_heap_erase(struct min_heap *s, struct event *e)
+{
+	struct event *last;
+	unsigned int parent;
+
+	if (MIN_HEAP_IDX(e) == MIN_HEAP_IDX_NONE)
+		return (-1);
+
+	last = s->p[--s->n];
+	if (MIN_HEAP_IDX(e) != s->n) {
+		/*
+		 * The last element takes the hole; move it up if it is
+		 * smaller than the parent of the hole, down otherwise.
+		 */
+		parent = (MIN_HEAP_IDX(e) - 1) / 2;
+		if (MIN_HEAP_IDX(e) > 0 &&
+		    min_heap_elem_greater(s->p[parent], last))
+			min_heap_shift_up_(s, MIN_HEAP_IDX(e), last);
+		else
+			min_heap_shift_down_(s, MIN_HEAP_IDX(e), last);
+	}
+	MIN_HEAP_IDX(e) = MIN_HEAP_IDX_NONE;
+	return (0);
+}
+
+#endif /* _MIN_HEAP_H_ */
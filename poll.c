@@ -30,6 +30,11 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_PPOLL
+/* Enable ppoll */
+#define _GNU_SOURCE
+#endif
+
 #include <sys/types.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
@@ -54,12 +59,9 @@
 #endif
 
 #include "event.h"
+#include "event-internal.h"
 #include "evsignal.h"
 
-extern struct event_list eventqueue;
-
-extern volatile sig_atomic_t evsignal_caught;
-
 /*
 struct pollfd {  
  int fd;        //文件描述符  
@@ -70,17 +72,25 @@ int poll(struct pollfd *ufds, unsigned int nfds, int timeout);
 */
 struct pollop {
 	int event_count;		/* Highest number alloc */
+	int nfds;			/* Size of event_* */
+	int fd_count;			/* Size of idxplus1_by_fd */
 	struct pollfd *event_set; /* poll的存储结构。 */
-	struct event **event_back;
-	sigset_t evsigmask; //每个类都需要注册信号的监管结构。
-} pollop;
+	struct event **event_r_back;	/* read event of each pollfd */
+	struct event **event_w_back;	/* write event of each pollfd */
+	int *idxplus1_by_fd;		/* Index into event_set by fd; we add
+					 * one so that 0 (which is easy to
+					 * memset) can mean "no entry." */
+	struct pollfd *event_set_copy;	/* what poll(2) gets with threads */
+	int copy_count;
+};
 //再看看这个博客
 //https://blog.csdn.net/zhuxiaoping54532/article/details/51701549
-void *poll_init	(void);
+void *poll_init	(struct event_base *);
 int poll_add		(void *, struct event *);
 int poll_del		(void *, struct event *);
-int poll_recalc	(void *, int);
-int poll_dispatch	(void *, struct timeval *);
+int poll_recalc	(struct event_base *, void *, int);
+int poll_dispatch	(struct event_base *, void *, struct timeval *);
+void poll_dealloc	(struct event_base *, void *);
 
 struct eventop pollops = {
 	"poll",
@@ -88,21 +98,27 @@ struct eventop pollops = {
 	poll_add,
 	poll_del,
 	poll_recalc,
-	poll_dispatch
+	poll_dispatch,
+	poll_dealloc,
+	EV_FEATURE_THREADS,
+	NULL
 };
 
 void *
-poll_init(void)
+poll_init(struct event_base *base)
 {
+	struct pollop *pollop;
+
 	/* Disable kqueue when this environment variable is set */
 	if (getenv("EVENT_NOPOLL"))
 		return (NULL);
 	/*基本上都是这样初始化结构体的。 */
-	memset(&pollop, 0, sizeof(pollop));
+	if (!(pollop = calloc(1, sizeof(struct pollop))))
+		return (NULL);
 
-	evsignal_init(&pollop.evsigmask);
+	evsignal_init(base);
 
-	return (&pollop);
+	return (pollop);
 }
 
 /*
@@ -113,76 +129,65 @@ poll_init(void)
 结构不一样，所以不需要重新初始化句柄。
 */
 int
-poll_recalc(void *arg, int max)
+poll_recalc(struct event_base *base, void *arg, int max)
 {
-	struct pollop *pop = arg;
-	
-	return (evsignal_recalc(&pop->evsigmask));
+	return (evsignal_recalc(base));
 }
 
 int
-poll_dispatch(void *arg, struct timeval *tv)
+poll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
-	int res, i, count, sec, nfds;
-	struct event *ev;
+	int res, i, j, nfds;
+	struct event *evread, *evwrite;
 	struct pollop *pop = arg;
+	struct pollfd *event_set;
+#ifdef HAVE_PPOLL
+	const sigset_t *sigmask = evsignal_waitmask(base);
+	struct timespec ts;
 
-	count = pop->event_count;
-	nfds = 0;
-	/*
-	设置循环，读取event的事件队列。设置要监听的句柄。
-	设置监听的信号。
-	*/
-	TAILQ_FOREACH(ev, &eventqueue, ev_next) {
-		if (nfds + 1 >= count) {
-			if (count < 32)
-				count = 32;
-			else
-				count *= 2;
-
-			/* We need more file descriptors */
-			pop->event_set = realloc(pop->event_set,
-			    count * sizeof(struct pollfd));
-			if (pop->event_set == NULL) {
-				log_error("realloc");
-				return (-1);
-			}
-			pop->event_back = realloc(pop->event_back,
-			    count * sizeof(struct event *));
-			if (pop->event_back == NULL) {
-				log_error("realloc");
-				return (-1);
-			}
-			pop->event_count = count;
-		}
-		if (ev->ev_events & EV_WRITE) {
-			struct pollfd *pfd = &pop->event_set[nfds];
-			pfd->fd = ev->ev_fd;
-			pfd->events = POLLOUT;
-			pfd->revents = 0;
-
-			pop->event_back[nfds] = ev;
-
-			nfds++;
-		}
-		if (ev->ev_events & EV_READ) {
-			struct pollfd *pfd = &pop->event_set[nfds];
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+#else
+	int sec;
 
-			pfd->fd = ev->ev_fd;
-			pfd->events = POLLIN;
-			pfd->revents = 0;
+	if (evsignal_deliver(base) == -1)
+		return (-1);
 
-			pop->event_back[nfds] = ev;
+	/* Rounded up, so that a short timeout does not spin on zero */
+	sec = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+#endif
 
-			nfds++;
+	nfds = pop->nfds;
+	event_set = pop->event_set;
+#ifdef HAVE_LIBPTHREAD
+	/* Other threads may change the array while poll(2) uses it */
+	if (base->th_lock != NULL && nfds > 0) {
+		if (pop->copy_count < pop->event_count) {
+			struct pollfd *copy;
+
+			copy = realloc(pop->event_set_copy,
+			    pop->event_count * sizeof(struct pollfd));
+			if (copy == NULL) {
+				log_error("realloc");
+				return (-1);
+			}
+			pop->event_set_copy = copy;
+			pop->copy_count = pop->event_count;
 		}
+		memcpy(pop->event_set_copy, pop->event_set,
+		    nfds * sizeof(struct pollfd));
+		event_set = pop->event_set_copy;
 	}
+#endif
 
-	if (evsignal_deliver(&pop->evsigmask) == -1)
-		return (-1);
-
-	sec = tv->tv_sec * 1000 + tv->tv_usec / 1000;
-	res = poll(pop->event_set, nfds, sec);
+	EVBASE_RELEASE_LOCK(base);
+#ifdef HAVE_PPOLL
+	/* Unblocks the signals only for the duration of the wait */
+	res = ppoll(event_set, nfds, &ts, sigmask);
+#else
+	res = poll(event_set, nfds, sec);
+#endif
+	EVBASE_ACQUIRE_LOCK(base);
 	/*返回值:
 	>0：数组fds中准备好读、写或出错状态的那些socket描述符的总数量；
     ==0：数组fds中没有任何socket描述符准备好读、写，或出错；此时poll超时，超时时间是timeout毫秒；
@@ -195,7 +200,7 @@ poll_dispatch(void *arg, struct timeval *tv)
 			也就是不会对成员变量events进行检测，在events上注册的事件也会被忽略，
 			poll()函数返回的时候，会把成员变量revents设置为0，表示没有事件发生；
 	*/
-	if (evsignal_recalc(&pop->evsigmask) == -1)
+	if (evsignal_recalc(base) == -1)
 		return (-1);
 
 	if (res == -1) {
@@ -204,70 +209,224 @@ poll_dispatch(void *arg, struct timeval *tv)
 			return (-1);
 		}
 
-		evsignal_process();
+		evsignal_process(base);
 		return (0);
-	} else if (evsignal_caught)
-		evsignal_process();
+	} else if (base->sig.evsignal_caught)
+		evsignal_process(base);
 
 	LOG_DBG((LOG_MISC, 80, "%s: poll reports %d", __func__, res));
 
 	if (res == 0)
 		return (0);
 
-	for (i = 0; i < nfds; i++) {
-                int what = pop->event_set[i].revents;
-		
+	/*
+	 * Deleting events moves the last entry into the hole, so walk
+	 * backwards to see every entry once.  Entries are looked up by fd
+	 * since they may have moved while we were waiting.
+	 */
+	for (i = nfds - 1; i >= 0; i--) {
+		int what = event_set[i].revents;
+
+		if (what == 0)
+			continue;
+
+		/* deleted by another thread while we were waiting */
+		if ((j = pop->idxplus1_by_fd[event_set[i].fd] - 1) < 0)
+			continue;
+
 		res = 0;
 		/*
 		文件不正常关闭时，也需要处理。
 		*/
 		/* If the file gets closed notify */
-		if (what & POLLHUP)
+		if (what & (POLLHUP|POLLERR))
 			what |= POLLIN|POLLOUT;
-                if (what & POLLERR) 
-                        what |= POLLIN|POLLOUT;
 		if (what & POLLIN)
 			res |= EV_READ;
 		if (what & POLLOUT)
 			res |= EV_WRITE;
-		if (res == 0)
-			continue;
 
-		ev = pop->event_back[i];
-		res &= ev->ev_events;
+		evread = (res & EV_READ) ? pop->event_r_back[j] : NULL;
+		evwrite = (res & EV_WRITE) ? pop->event_w_back[j] : NULL;
+
+		if (evread != NULL && !(evread->ev_events & EV_PERSIST))
+			event_del(evread);
+		if (evwrite != NULL && evwrite != evread &&
+		    !(evwrite->ev_events & EV_PERSIST))
+			event_del(evwrite);
+
+		if (evread != NULL && evread == evwrite)
+			event_active(evread, EV_READ|EV_WRITE, 1);
+		else {
+			if (evread != NULL)
+				event_active(evread, EV_READ, 1);
+			if (evwrite != NULL)
+				event_active(evwrite, EV_WRITE, 1);
+		}
+	}
+
+	return (0);
+}
 
-		if (res) {
-			if (!(ev->ev_events & EV_PERSIST))
-				event_del(ev);
-			event_active(ev, res, 1);
-		}	
+static int
+poll_grow(struct pollop *pop, int fd)
+{
+	if (pop->nfds == pop->event_count) {
+		struct pollfd *event_set;
+		struct event **r_back, **w_back;
+		int count = pop->event_count < 32 ? 32 : pop->event_count * 2;
+
+		/* We need more file descriptors */
+		event_set = realloc(pop->event_set,
+		    count * sizeof(struct pollfd));
+		if (event_set == NULL) {
+			log_error("realloc");
+			return (-1);
+		}
+		pop->event_set = event_set;
+
+		r_back = realloc(pop->event_r_back,
+		    count * sizeof(struct event *));
+		if (r_back == NULL) {
+			log_error("realloc");
+			return (-1);
+		}
+		pop->event_r_back = r_back;
+
+		w_back = realloc(pop->event_w_back,
+		    count * sizeof(struct event *));
+		if (w_back == NULL) {
+			log_error("realloc");
+			return (-1);
+		}
+		pop->event_w_back = w_back;
+
+		pop->event_count = count;
+	}
+
+	if (fd >= pop->fd_count) {
+		int *idxplus1_by_fd;
+		int count = pop->fd_count < 32 ? 32 : pop->fd_count;
+
+		while (count <= fd)
+			count *= 2;
+		idxplus1_by_fd = realloc(pop->idxplus1_by_fd,
+		    count * sizeof(int));
+		if (idxplus1_by_fd == NULL) {
+			log_error("realloc");
+			return (-1);
+		}
+		memset(idxplus1_by_fd + pop->fd_count, 0,
+		    (count - pop->fd_count) * sizeof(int));
+		pop->idxplus1_by_fd = idxplus1_by_fd;
+		pop->fd_count = count;
 	}
 
 	return (0);
 }
 
+/*
+ * Read and write interest in one fd share a pollfd.  The entry is made
+ * when the first event for the fd comes in, and removed when the last
+ * one goes away.
+ */
 int
 poll_add(void *arg, struct event *ev)
 {
 	struct pollop *pop = arg;
+	struct pollfd *pfd;
+	int i;
 
 	if (ev->ev_events & EV_SIGNAL)
-		return (evsignal_add(&pop->evsigmask, ev));
+		return (evsignal_add(ev));
+	if (!(ev->ev_events & (EV_READ|EV_WRITE)))
+		return (0);
+
+	if (poll_grow(pop, ev->ev_fd) == -1)
+		return (-1);
+
+	i = pop->idxplus1_by_fd[ev->ev_fd] - 1;
+	if (i < 0) {
+		i = pop->nfds++;
+		pfd = &pop->event_set[i];
+		pfd->fd = ev->ev_fd;
+		pfd->events = 0;
+		pfd->revents = 0;
+		pop->event_r_back[i] = NULL;
+		pop->event_w_back[i] = NULL;
+		pop->idxplus1_by_fd[ev->ev_fd] = i + 1;
+	} else
+		pfd = &pop->event_set[i];
+
+	if (ev->ev_events & EV_READ) {
+		pfd->events |= POLLIN;
+		pop->event_r_back[i] = ev;
+	}
+	if (ev->ev_events & EV_WRITE) {
+		pfd->events |= POLLOUT;
+		pop->event_w_back[i] = ev;
+	}
 
 	return (0);
 }
 
-/*
- * Nothing to be done here.
- */
-
 int
 poll_del(void *arg, struct event *ev)
 {
 	struct pollop *pop = arg;
+	struct pollfd *pfd;
+	int i, last;
+
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_del(ev));
+	if (!(ev->ev_events & (EV_READ|EV_WRITE)))
+		return (0);
+
+	if (ev->ev_fd >= pop->fd_count ||
+	    (i = pop->idxplus1_by_fd[ev->ev_fd] - 1) < 0)
+		return (0);
 
-	if (!(ev->ev_events & EV_SIGNAL))
+	pfd = &pop->event_set[i];
+	if ((ev->ev_events & EV_READ) && pop->event_r_back[i] == ev) {
+		pfd->events &= ~POLLIN;
+		pop->event_r_back[i] = NULL;
+	}
+	if ((ev->ev_events & EV_WRITE) && pop->event_w_back[i] == ev) {
+		pfd->events &= ~POLLOUT;
+		pop->event_w_back[i] = NULL;
+	}
+	if (pfd->events)
 		return (0);
 
-	return (evsignal_del(&pop->evsigmask, ev));
+	/* Nothing left for this fd; fill the hole with the last entry */
+	pop->idxplus1_by_fd[ev->ev_fd] = 0;
+	last = --pop->nfds;
+	if (i != last) {
+		pop->event_set[i] = pop->event_set[last];
+		pop->event_r_back[i] = pop->event_r_back[last];
+		pop->event_w_back[i] = pop->event_w_back[last];
+		pop->idxplus1_by_fd[pop->event_set[i].fd] = i + 1;
+	}
+
+	return (0);
+}
+
+void
+poll_dealloc(struct event_base *base, void *arg)
+{
+	struct pollop *pop = arg;
+
+	evsignal_dealloc(base);
+	if (pop->event_set)
+		free(pop->event_set);
+	if (pop->event_r_back)
+		free(pop->event_r_back);
+	if (pop->event_w_back)
+		free(pop->event_w_back);
+	if (pop->idxplus1_by_fd)
+		free(pop->idxplus1_by_fd);
+	if (pop->event_set_copy)
+		free(pop->event_set_copy);
+
+	free(pop);
 }
@@ -28,14 +28,22 @@
 #define EVLIST_X_NORT	0x1000	/* Skip RT signals (internal) */
 
 #include "event.h"
-extern struct event_list eventqueue;
-extern struct event_list signalqueue;
+#include "event-internal.h"
+
+/* The events registered for one fd */
+struct rtsigfd {
+    struct event *evread;
+    struct event *evwrite;
+    int pollidx;	/* index of the fd in poll plus one, 0 if not polled */
+};
 
 struct rtsigop {
     sigset_t sigs;
-    struct pollfd *poll;
-    struct event **toev;
-    int cur, max, total;
+    struct pollfd *poll;	/* fds that signalled and may still be ready */
+    int cur, max;
+    struct rtsigfd *fds;	/* indexed by fd */
+    int nfds;
+    int resync;			/* signals were lost, poll every fd once */
 #ifndef HAVE_WORKING_RTSIG
     int pollmode;
 #endif
@@ -43,12 +51,22 @@ struct rtsigop {
 
 #define INIT_MAX 16
 
+/* Puts fd into the poll set, or updates its entry */
 static int
-poll_add(struct rtsigop *op, struct event *ev)
+poll_add(struct rtsigop *op, int fd)
 {
+    struct rtsigfd *rfd = &op->fds[fd];
     struct pollfd *pfd;
+    short events = 0;
 
-    if (op->poll == NULL) return 0;
+    if (rfd->evread != NULL) events |= POLLIN;
+    if (rfd->evwrite != NULL) events |= POLLOUT;
+    if (!events) return 0;
+
+    if (rfd->pollidx) {
+        op->poll[rfd->pollidx - 1].events = events;
+        return 0;
+    }
 
     if (op->cur == op->max) {
         void *p;
@@ -59,25 +77,15 @@ poll_add(struct rtsigop *op, struct event *ev)
             return -1;
         }
         op->poll = p;
-        p = realloc(op->toev, sizeof(*op->toev) * (op->max << 1));
-        if (!p) {
-            op->poll = realloc(op->poll, sizeof(*op->poll) * op->max);
-            errno = ENOMEM;
-            return -1;
-        }
-        op->toev = p;
         op->max <<= 1;
     }
 
     pfd = &op->poll[op->cur];
-    pfd->fd = ev->ev_fd;
-    pfd->events = 0;
-    if (ev->ev_events & EV_READ) pfd->events |= POLLIN;
-    if (ev->ev_events & EV_WRITE) pfd->events |= POLLOUT;
+    pfd->fd = fd;
+    pfd->events = events;
     pfd->revents = 0;
 
-    op->toev[op->cur] = ev;
-    op->cur++;
+    rfd->pollidx = ++op->cur;
 
     return 0;
 }
@@ -85,31 +93,53 @@ poll_add(struct rtsigop *op, struct event *ev)
 static void
 poll_free(struct rtsigop *op, int n)
 {
-    if (op->poll == NULL) return;
+    op->fds[op->poll[n].fd].pollidx = 0;
 
     op->cur--;
     if (n < op->cur) {
         memcpy(&op->poll[n], &op->poll[op->cur], sizeof(*op->poll));
-        op->toev[n] = op->toev[op->cur];
+        op->fds[op->poll[n].fd].pollidx = n + 1;
     }
     if (op->max > INIT_MAX && op->cur < op->max >> 1) {
-        op->max >>= 1;
-        op->poll = realloc(op->poll, sizeof(*op->poll) * op->max);
-        op->toev = realloc(op->toev, sizeof(*op->toev) * op->max);
+        void *p = realloc(op->poll, sizeof(*op->poll) * (op->max >> 1));
+
+        if (p) {
+            op->poll = p;
+            op->max >>= 1;
+        }
     }
 }
 
+/* Takes the interest that is gone out of the poll set */
 static void
-poll_remove(struct rtsigop *op, struct event *ev)
+poll_remove(struct rtsigop *op, int fd)
 {
-    int i;
+    struct rtsigfd *rfd = &op->fds[fd];
 
-    for (i = 0; i < op->cur; i++) {
-        if (op->toev[i] == ev) {
-            poll_free(op, i);
-            break;
-        }
-    }
+    if (!rfd->pollidx)
+        return;
+
+    if (rfd->evread == NULL && rfd->evwrite == NULL)
+        poll_free(op, rfd->pollidx - 1);
+    else
+        poll_add(op, fd);
+}
+
+/*
+ * After signals were lost, any fd may be ready.  Entries that turn out
+ * not to be ready leave the poll set again after one round.
+ */
+static int
+poll_resync(struct rtsigop *op)
+{
+    int fd;
+
+    for (fd = 0; fd < op->nfds; fd++)
+        if (poll_add(op, fd) == -1)
+            return -1;
+
+    op->resync = 0;
+    return 0;
 }
 
 static void
@@ -119,11 +149,12 @@ activate(struct event *ev, int flags)
     event_active(ev, flags, 1);
 }
 
-void *rtsig_init(void);
+void *rtsig_init(struct event_base *);
 int rtsig_add(void *, struct event *);
 int rtsig_del(void *, struct event *);
-int rtsig_recalc(void *, int);
-int rtsig_dispatch(void *, struct timeval *);
+int rtsig_recalc(struct event_base *, void *, int);
+int rtsig_dispatch(struct event_base *, void *, struct timeval *);
+void rtsig_dealloc(struct event_base *, void *);
 
 struct eventop rtsigops = {
     "rtsig",
@@ -131,11 +162,14 @@ struct eventop rtsigops = {
     rtsig_add,
     rtsig_del,
     rtsig_recalc,
-    rtsig_dispatch
+    rtsig_dispatch,
+    rtsig_dealloc,
+    0,
+    NULL
 };
 
 void *
-rtsig_init(void)
+rtsig_init(struct event_base *base)
 {
 	struct rtsigop *op;
 
@@ -153,12 +187,6 @@ rtsig_init(void)
 		free(op);
 		return (NULL);
 	}
-	op->toev = malloc(sizeof(*op->toev) * op->max);
-	if (op->toev == NULL) {
-		free(op->poll);
-		free(op);
-		return (NULL);
-	}
 
 	sigemptyset(&op->sigs);
 	sigaddset(&op->sigs, SIGIO);
@@ -168,10 +196,34 @@ rtsig_init(void)
 	return (op);
 }
 
+static int
+rtsig_grow(struct rtsigop *op, int fd)
+{
+	struct rtsigfd *fds;
+	int nfds;
+
+	if (fd < op->nfds)
+		return (0);
+
+	nfds = op->nfds ? op->nfds : INIT_MAX;
+	while (nfds <= fd)
+		nfds <<= 1;
+
+	fds = realloc(op->fds, nfds * sizeof(struct rtsigfd));
+	if (fds == NULL)
+		return (-1);
+	memset(fds + op->nfds, 0, (nfds - op->nfds) * sizeof(struct rtsigfd));
+	op->fds = fds;
+	op->nfds = nfds;
+
+	return (0);
+}
+
 int
 rtsig_add(void *arg, struct event *ev)
 {
 	struct rtsigop *op = (struct rtsigop *) arg;
+	struct rtsigfd *rfd;
 	int flags, i;
 #ifndef HAVE_WORKING_RTSIG
 	struct stat st;
@@ -184,6 +236,9 @@ rtsig_add(void *arg, struct event *ev)
 
 	if (!(ev->ev_events & (EV_READ | EV_WRITE))) return 0;
 
+	if (rtsig_grow(op, ev->ev_fd) == -1)
+		return (-1);
+
 #ifndef HAVE_WORKING_RTSIG
 	if (fstat(ev->ev_fd, &st) == -1) return -1;
 	if (S_ISFIFO(st.st_mode)) {
@@ -209,14 +264,24 @@ rtsig_add(void *arg, struct event *ev)
 	fcntl(ev->ev_fd, F_SETAUXFL, O_ONESIGFD);
 #endif
 
-	op->total++;
-	if (poll_add(op, ev) == -1)
+	rfd = &op->fds[ev->ev_fd];
+	if (ev->ev_events & EV_READ)
+		rfd->evread = ev;
+	if (ev->ev_events & EV_WRITE)
+		rfd->evwrite = ev;
+
+	/* It may be ready already, without ever sending a signal */
+	if (poll_add(op, ev->ev_fd) == -1)
 		goto err;
 
 	return (0);
 
  err:
 	i = errno;
+	if (ev->ev_events & EV_READ)
+		rfd->evread = NULL;
+	if (ev->ev_events & EV_WRITE)
+		rfd->evwrite = NULL;
 	fcntl(ev->ev_fd, F_SETFL, flags);
 	errno = i;
 	return (-1);
@@ -226,6 +291,7 @@ int
 rtsig_del(void *arg, struct event *ev)
 {
 	struct rtsigop *op = (struct rtsigop *) arg;
+	struct rtsigfd *rfd;
 
 	if (ev->ev_events & EV_SIGNAL) {
 		sigset_t sigs;
@@ -244,31 +310,38 @@ rtsig_del(void *arg, struct event *ev)
 	if (ev->ev_flags & EVLIST_X_NORT)
 		op->pollmode--;
 #endif
-	poll_remove(op, ev);
-	op->total--;
+	if (ev->ev_fd >= op->nfds)
+		return (0);
+
+	rfd = &op->fds[ev->ev_fd];
+	if (rfd->evread == ev)
+		rfd->evread = NULL;
+	if (rfd->evwrite == ev)
+		rfd->evwrite = NULL;
+	poll_remove(op, ev->ev_fd);
 
 	return (0);
 }
 
 int
-rtsig_recalc(void *arg, int max)
+rtsig_recalc(struct event_base *base, void *arg, int max)
 {
     return (0);
 }
 
 int
-rtsig_dispatch(void *arg, struct timeval *tv)
+rtsig_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
 	struct rtsigop *op = (struct rtsigop *) arg;
 	struct timespec ts;
 	int res, i;
 
-	if (op->poll == NULL)
-		goto retry_poll;
 #ifndef HAVE_WORKING_RTSIG
 	if (op->pollmode)
-		goto poll_all;
+		op->resync = 1;
 #endif
+	if (op->resync && poll_resync(op) == -1)
+		return (-1);
 
 	if (op->cur) {
 		ts.tv_sec = ts.tv_nsec = 0;
@@ -293,72 +366,34 @@ rtsig_dispatch(void *arg, struct timeval *tv)
 		ts.tv_sec = ts.tv_nsec = 0;
 
 		if (signum == SIGIO) {
-#ifndef HAVE_WORKING_RTSIG
-		poll_all:
-#endif
-			free(op->poll);
-			free(op->toev);
-		retry_poll:
-			op->cur = 0;
-			op->max = op->total;
-			op->poll = malloc(sizeof(*op->poll) * op->total);
-			if (op->poll == NULL)
+			/* The signal queue overflowed */
+			op->resync = 1;
+			if (poll_resync(op) == -1)
 				return (-1);
-			op->toev = malloc(sizeof(*op->toev) * op->total);
-			if (op->toev == NULL) {
-				free(op->poll);
-				op->poll = NULL;
-				return (-1);
-			}
-
-			TAILQ_FOREACH(ev, &eventqueue, ev_next)
-			    if (!(ev->ev_flags & EVLIST_X_NORT))
-				    poll_add(op, ev);
-
 			break;
 		}
 
 		if (signum == SIGRTMIN) {
-			int flags, i, sigok = 0;
-
-			if (info.si_band <= 0) { /* SI_SIGIO */
-				flags = EV_READ | EV_WRITE;
-			} else {
-				flags = 0;
-				if (info.si_band & POLLIN) flags |= EV_READ;
-				if (info.si_band & POLLOUT) flags |= EV_WRITE;
-				if (!flags) continue;
-			}
+			int fd = info.si_fd, flags;
 
-			for (i = 0; flags && i < op->cur; i++) {
-				ev = op->toev[i];
-
-				if (ev->ev_fd == info.si_fd) {
-					flags &= ~ev->ev_events;
-					sigok = 1;
-				}
-			}
+			if (info.si_band > 0 &&
+			    !(info.si_band & (POLLIN | POLLOUT)))
+				continue;
 
-			for (ev = TAILQ_FIRST(&eventqueue);
-			    flags && ev != TAILQ_END(&eventqueue);
-			    ev = TAILQ_NEXT(ev, ev_next)) {
-				if (ev->ev_fd == info.si_fd) {
-					if (flags & ev->ev_events) {
-						i = poll_add(op, ev);
-						if (i == -1) return -1;
-						flags &= ~ev->ev_events;
-					}
-					sigok = 1;
-				}
+			if (fd >= 0 && fd < op->nfds &&
+			    (op->fds[fd].evread != NULL ||
+				op->fds[fd].evwrite != NULL)) {
+				if (poll_add(op, fd) == -1)
+					return (-1);
+				continue;
 			}
 
-			if (!sigok) {
-				flags = fcntl(info.si_fd, F_GETFL);
-				if (flags == -1) return -1;
-				fcntl(info.si_fd, F_SETFL, flags & ~O_ASYNC);
-			}
+			/* Nobody is interested in this fd any longer */
+			flags = fcntl(fd, F_GETFL);
+			if (flags == -1) return -1;
+			fcntl(fd, F_SETFL, flags & ~O_ASYNC);
 		} else {
-			TAILQ_FOREACH(ev, &signalqueue, ev_signal_next) {
+			TAILQ_FOREACH(ev, &base->signalqueue, ev_signal_next) {
 				if (EVENT_SIGNAL(ev) == signum)
 					activate(ev, EV_SIGNAL);
 			}
@@ -372,63 +407,59 @@ rtsig_dispatch(void *arg, struct timeval *tv)
 	if (res < 0)
 		return (-1);
 
-	i = 0;
-#ifdef HAVE_WORKING_RTSIG
-	while (i < res) {
-#else
-	while (i < op->cur) {
-#endif
-		if (op->poll[i].revents) {
-			int flags = 0;
-			struct event *ev = op->toev[i];
-
-			if (op->poll[i].revents & POLLIN)
-				flags |= EV_READ;
-			if (op->poll[i].revents & POLLOUT)
-				flags |= EV_WRITE;
-
-			if (!(ev->ev_events & EV_PERSIST)) {
-				event_del(ev);
-				res--;
-			} else {
-				i++;
-			}
-			event_active(ev, flags, 1);
-		} else {
+	/*
+	 * Deleting events and dropping idle fds both move the last entry
+	 * into the hole, so walk backwards to see every entry once.
+	 */
+	for (i = op->cur - 1; i >= 0; i--) {
+		struct rtsigfd *rfd = &op->fds[op->poll[i].fd];
+		struct event *evread, *evwrite;
+		int what = op->poll[i].revents;
+
+		if (!what) {
 #ifndef HAVE_WORKING_RTSIG
-			if (op->toev[i]->ev_flags & EVLIST_X_NORT) {
-				i++;
-				res++;
+			if ((rfd->evread != NULL &&
+				(rfd->evread->ev_flags & EVLIST_X_NORT)) ||
+			    (rfd->evwrite != NULL &&
+				(rfd->evwrite->ev_flags & EVLIST_X_NORT)))
 				continue;
-			}
 #endif
-			for (;;) {
-				op->cur--;
-				if (i == op->cur)
-					break;
-				if (op->poll[op->cur].revents) {
-					memcpy(&op->poll[i], &op->poll[op->cur], sizeof(*op->poll));
-					op->toev[i] = op->toev[op->cur];
-					break;
-				}
-			}
+			/* Not ready; the next signal brings it back */
+			poll_free(op, i);
+			continue;
 		}
-	}
-#ifdef HAVE_WORKING_RTSIG
-	op->cur = res;
-#endif
 
-	if (!op->cur) {
-		op->max = INIT_MAX;
-		free(op->poll);
-		free(op->toev);
-		/* We just freed it, we shouldn't have a problem getting it back. */
-		op->poll = malloc(sizeof(*op->poll) * op->max);
-		op->toev = malloc(sizeof(*op->toev) * op->max);
+		if (what & (POLLHUP | POLLERR))
+			what |= POLLIN | POLLOUT;
+		evread = (what & POLLIN) ? rfd->evread : NULL;
+		evwrite = (what & POLLOUT) ? rfd->evwrite : NULL;
 
-		if (op->poll == NULL || op->toev == NULL)
-			err(1, "%s: malloc");
+		if (evread == NULL && evwrite == NULL) {
+			poll_free(op, i);
+			continue;
+		}
+		if (evread != NULL && evread == evwrite) {
+			activate(evread, EV_READ | EV_WRITE);
+			continue;
+		}
+		if (evread != NULL)
+			activate(evread, EV_READ);
+		if (evwrite != NULL)
+			activate(evwrite, EV_WRITE);
 	}
 
 	return (0);
 }
+
+void
+rtsig_dealloc(struct event_base *base, void *arg)
+{
+	struct rtsigop *op = (struct rtsigop *) arg;
+
+	if (op->poll)
+		free(op->poll);
+	if (op->fds)
+		free(op->fds);
+
+	free(op);
+}
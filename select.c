@@ -53,30 +53,32 @@
 #endif
 
 #include "event.h"
+#include "event-internal.h"
 #include "evsignal.h"
 
-extern struct event_list eventqueue;
-
 #ifndef howmany
 #define        howmany(x, y)   (((x)+((y)-1))/(y))
 #endif
 
-extern volatile sig_atomic_t evsignal_caught;
-
 struct selectop {
 	/* 最大的文件句柄。*/
 	int event_fds;		/* Highest fd in fd set */
 	int event_fdsz;		// 存储信号集需要的字节大小。
-	fd_set *event_readset;/* 读信号事件集合*/
-	fd_set *event_writeset;/* 写信号事件集合*/
-	sigset_t evsigmask;// linux 信号集。用于检测是否有信号发送过来。
-} sop;
+	int event_out_fdsz;	/* size of the sets handed to select(2) */
+	fd_set *event_readset_in;	/* 读信号事件集合*/
+	fd_set *event_writeset_in;	/* 写信号事件集合*/
+	fd_set *event_readset_out;	/* copies that select(2) overwrites */
+	fd_set *event_writeset_out;
+	struct event **event_r_by_fd;
+	struct event **event_w_by_fd;
+};
 
-void *select_init	(void);
+void *select_init	(struct event_base *);
 int select_add		(void *, struct event *);
 int select_del		(void *, struct event *);
-int select_recalc	(void *, int);
-int select_dispatch	(void *, struct timeval *);
+int select_recalc	(struct event_base *, void *, int);
+int select_dispatch	(struct event_base *, void *, struct timeval *);
+void select_dealloc	(struct event_base *, void *);
 
 const struct eventop selectops = {
 	"select",
@@ -84,115 +86,200 @@ const struct eventop selectops = {
 	select_add,
 	select_del,
 	select_recalc,
-	select_dispatch
+	select_dispatch,
+	select_dealloc,
+	EV_FEATURE_THREADS,
+	NULL
 };
 
 void *
-select_init(void)
+select_init(struct event_base *base)
 {
+	struct selectop *sop;
+
 	/* Disable kqueue when this environment variable is set */
 	if (getenv("EVENT_NOSELECT"))
 		return (NULL);
 
-	memset(&sop, 0, sizeof(sop));
+	if (!(sop = calloc(1, sizeof(struct selectop))))
+		return (NULL);
 
-	evsignal_init(&sop.evsigmask);
+	evsignal_init(base);
 
-	return (&sop);
+	return (sop);
 }
 
-/*
- * Called with the highest fd that we know about.  If it is 0, completely
- * recalculate everything.
- */
-
-int
-select_recalc(void *arg, int max)
+/* Makes room for fd in the master sets and the event tables */
+static int
+select_resize(struct selectop *sop, int fd)
 {
-	struct selectop *sop = arg;
 	fd_set *readset, *writeset;
-	struct event *ev;
-	int fdsz;
-	/*
-	设置event_fds为最大值
-	*/
-	if (sop->event_fds < max)
-		sop->event_fds = max;
-	/*
-	如果event_fds不存在，则遍历队列，取最大值。
-	*/
-	if (!sop->event_fds) {
-		TAILQ_FOREACH(ev, &eventqueue, ev_next)
-			if (ev->ev_fd > sop->event_fds)
-				sop->event_fds = ev->ev_fd;
-	}
+	struct event **r_by_fd, **w_by_fd;
+	int fdsz, n, oldn;
+
 	/*
 	计算存储event_fds所需要的位数。
 	*/
-	fdsz = howmany(sop->event_fds + 1, NFDBITS) * sizeof(fd_mask);
-	if (fdsz > sop->event_fdsz) {
-		if ((readset = realloc(sop->event_readset, fdsz)) == NULL) {
-			log_error("malloc");
-			return (-1);
-		}
+	fdsz = howmany(fd + 1, NFDBITS) * sizeof(fd_mask);
+	if (fdsz <= sop->event_fdsz)
+		return (0);
 
-		if ((writeset = realloc(sop->event_writeset, fdsz)) == NULL) {
-			log_error("malloc");
-			free(readset);
-			return (-1);
-		}
+	/* Grow by doubling so that adding fds one by one stays cheap */
+	if (fdsz < sop->event_fdsz * 2)
+		fdsz = sop->event_fdsz * 2;
 
-		memset((char *)readset + sop->event_fdsz, 0,
-		    fdsz - sop->event_fdsz);
-		memset((char *)writeset + sop->event_fdsz, 0,
-		    fdsz - sop->event_fdsz);
+	if ((readset = realloc(sop->event_readset_in, fdsz)) == NULL) {
+		log_error("malloc");
+		return (-1);
+	}
+	sop->event_readset_in = readset;
+	if ((writeset = realloc(sop->event_writeset_in, fdsz)) == NULL) {
+		log_error("malloc");
+		return (-1);
+	}
+	sop->event_writeset_in = writeset;
 
-		sop->event_readset = readset;
-		sop->event_writeset = writeset;
-		sop->event_fdsz = fdsz;
+	n = fdsz / sizeof(fd_mask) * NFDBITS;
+	oldn = sop->event_fdsz / sizeof(fd_mask) * NFDBITS;
+	r_by_fd = realloc(sop->event_r_by_fd, n * sizeof(struct event *));
+	if (r_by_fd == NULL) {
+		log_error("malloc");
+		return (-1);
 	}
+	sop->event_r_by_fd = r_by_fd;
+	w_by_fd = realloc(sop->event_w_by_fd, n * sizeof(struct event *));
+	if (w_by_fd == NULL) {
+		log_error("malloc");
+		return (-1);
+	}
+	sop->event_w_by_fd = w_by_fd;
+
+	memset((char *)readset + sop->event_fdsz, 0,
+	    fdsz - sop->event_fdsz);
+	memset((char *)writeset + sop->event_fdsz, 0,
+	    fdsz - sop->event_fdsz);
+	memset(r_by_fd + oldn, 0, (n - oldn) * sizeof(struct event *));
+	memset(w_by_fd + oldn, 0, (n - oldn) * sizeof(struct event *));
+
+	sop->event_fdsz = fdsz;
 
-	return (evsignal_recalc(&sop->evsigmask));
+	return (0);
+}
+
+/*
+ * Called with the highest fd that we know about.  The sets are kept up
+ * to date by select_add and select_del, so only make sure they fit.
+ */
+
+int
+select_recalc(struct event_base *base, void *arg, int max)
+{
+	struct selectop *sop = arg;
+
+	if (select_resize(sop, max) == -1)
+		return (-1);
+
+	return (evsignal_recalc(base));
+}
+
+/* Index of the lowest bit that is set in a non-zero word */
+static __inline int
+select_ffs(unsigned long word)
+{
+#if defined(__GNUC__)
+	return (__builtin_ctzl(word));
+#else
+	int bit = 0;
+
+	while (!(word & 1)) {
+		word >>= 1;
+		bit++;
+	}
+	return (bit);
+#endif
 }
 
 /*
 下发任务，发起一次，select。等待信号发送。
 */
 int
-select_dispatch(void *arg, struct timeval *tv)	
+select_dispatch(struct event_base *base, void *arg, struct timeval *tv)	
 {
-	int maxfd, res;
-	struct event *ev, *next;
+	int nfds, res, fdsz, i, fd;
+	struct event *evread, *evwrite;
 	struct selectop *sop = arg;
+	fd_mask *rbits, *wbits;
+	unsigned long word;
+#ifdef HAVE_PSELECT
+	const sigset_t *sigmask = evsignal_waitmask(base);
+	struct timespec ts;
+
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+#endif
 
-	memset(sop->event_readset, 0, sop->event_fdsz);
-	memset(sop->event_writeset, 0, sop->event_fdsz);
 	/*
-	再初始化，信号集。
-	*/
-	TAILQ_FOREACH(ev, &eventqueue, ev_next) {
-		if (ev->ev_events & EV_WRITE)
-			FD_SET(ev->ev_fd, sop->event_writeset);
-		if (ev->ev_events & EV_READ)
-			FD_SET(ev->ev_fd, sop->event_readset);
+	 * select(2) overwrites its sets, so it gets copies of the master
+	 * sets.  Those are only resized here, because other threads may
+	 * change the master sets while we wait.
+	 */
+	fdsz = sop->event_fdsz;
+	if (sop->event_out_fdsz < fdsz) {
+		fd_set *readset, *writeset;
+
+		if ((readset = realloc(sop->event_readset_out,
+			 fdsz)) == NULL) {
+			log_error("malloc");
+			return (-1);
+		}
+		sop->event_readset_out = readset;
+		if ((writeset = realloc(sop->event_writeset_out,
+			 fdsz)) == NULL) {
+			log_error("malloc");
+			return (-1);
+		}
+		sop->event_writeset_out = writeset;
+		sop->event_out_fdsz = fdsz;
 	}
+
+#ifndef HAVE_PSELECT
 	/*
 	先注册信号。
 	*/
-	if (evsignal_deliver(&sop->evsigmask) == -1)
+	if (evsignal_deliver(base) == -1)
 		return (-1);
+#endif
+
 	/*
 	调用select函数，等待事件发送。
 	tv如果有值，则超时自动返回。
 	*/
-	res = select(sop->event_fds + 1, sop->event_readset, 
-	    sop->event_writeset, NULL, tv);
+	nfds = sop->event_fds + 1;
+	fdsz = howmany(nfds, NFDBITS) * sizeof(fd_mask);
+	if (fdsz > sop->event_fdsz)
+		fdsz = sop->event_fdsz;	/* no fd has been added yet */
+	if (fdsz > 0) {
+		memcpy(sop->event_readset_out, sop->event_readset_in, fdsz);
+		memcpy(sop->event_writeset_out, sop->event_writeset_in, fdsz);
+	} else
+		nfds = 0;
+
+	EVBASE_RELEASE_LOCK(base);
+#ifdef HAVE_PSELECT
+	/* Unblocks the signals only for the duration of the wait */
+	res = pselect(nfds, sop->event_readset_out,
+	    sop->event_writeset_out, NULL, &ts, sigmask);
+#else
+	res = select(nfds, sop->event_readset_out,
+	    sop->event_writeset_out, NULL, tv);
+#endif
+	EVBASE_ACQUIRE_LOCK(base);
 	/*
 	select函数完后。需再重新注册信号事件。
 	如果select中有事件发生，需要再重新注册一遍事件。或者select中，是事件触发select结束
 	会导致程序未处理接下来的信号事件
 	*/
-	if (evsignal_recalc(&sop->evsigmask) == -1)
+	if (evsignal_recalc(base) == -1)
 		return (-1);
 
 	if (res == -1) {
@@ -203,38 +290,52 @@ select_dispatch(void *arg, struct timeval *tv)
 		/*
 		处理信号。
 		*/
-		evsignal_process();
+		evsignal_process(base);
 		return (0);
-	} else if (evsignal_caught)
-		evsignal_process();
+	} else if (base->sig.evsignal_caught)
+		evsignal_process(base);
 
 	LOG_DBG((LOG_MISC, 80, "%s: select reports %d", __func__, res));
+
+	if (res == 0)
+		return (0);
+
 	/*
-	监听读事件，或者写事件，是否有事件发生。
-	*/
-	maxfd = 0;
-	for (ev = TAILQ_FIRST(&eventqueue); ev != NULL; ev = next) {
-		next = TAILQ_NEXT(ev, ev_next);
-
-		res = 0;
-		if (FD_ISSET(ev->ev_fd, sop->event_readset))
-			res |= EV_READ;
-		if (FD_ISSET(ev->ev_fd, sop->event_writeset))
-			res |= EV_WRITE;
-		res &= ev->ev_events;
-
-		if (res) {
-			if (!(ev->ev_events & EV_PERSIST))
-				event_del(ev);
-			else if (ev->ev_fd > maxfd)
-				maxfd = ev->ev_fd;
-			event_active(ev, res, 1);
-		} else if (ev->ev_fd > maxfd)
-			maxfd = ev->ev_fd;
+	 * Only look at the words that have bits set, and only at the bits
+	 * that are set in them, instead of testing every fd up to nfds.
+	 */
+	rbits = (fd_mask *)sop->event_readset_out;
+	wbits = (fd_mask *)sop->event_writeset_out;
+	for (i = 0; i < fdsz / (int)sizeof(fd_mask); i++) {
+		word = (unsigned long)rbits[i] | (unsigned long)wbits[i];
+		while (word) {
+			fd = i * NFDBITS + select_ffs(word);
+			word &= word - 1;
+
+			/* deleted by another thread while we were waiting */
+			evread = FD_ISSET(fd, sop->event_readset_out) ?
+			    sop->event_r_by_fd[fd] : NULL;
+			evwrite = FD_ISSET(fd, sop->event_writeset_out) ?
+			    sop->event_w_by_fd[fd] : NULL;
+
+			if (evread != NULL &&
+			    !(evread->ev_events & EV_PERSIST))
+				event_del(evread);
+			if (evwrite != NULL && evwrite != evread &&
+			    !(evwrite->ev_events & EV_PERSIST))
+				event_del(evwrite);
+
+			if (evread != NULL && evread == evwrite)
+				event_active(evread, EV_READ|EV_WRITE, 1);
+			else {
+				if (evread != NULL)
+					event_active(evread, EV_READ, 1);
+				if (evwrite != NULL)
+					event_active(evwrite, EV_WRITE, 1);
+			}
+		}
 	}
 
-	sop->event_fds = maxfd;
-
 	return (0);
 }
 
@@ -250,7 +351,10 @@ select_add(void *arg, struct event *ev)
 	struct selectop *sop = arg;
 
 	if (ev->ev_events & EV_SIGNAL)
-		return (evsignal_add(&sop->evsigmask, ev));
+		return (evsignal_add(ev));
+
+	if (select_resize(sop, ev->ev_fd) == -1)
+		return (-1);
 
 	/* 
 	 * Keep track of the highest fd, so that we can calculate the size
@@ -259,11 +363,19 @@ select_add(void *arg, struct event *ev)
 	if (sop->event_fds < ev->ev_fd)
 		sop->event_fds = ev->ev_fd;
 
+	if (ev->ev_events & EV_READ) {
+		FD_SET(ev->ev_fd, sop->event_readset_in);
+		sop->event_r_by_fd[ev->ev_fd] = ev;
+	}
+	if (ev->ev_events & EV_WRITE) {
+		FD_SET(ev->ev_fd, sop->event_writeset_in);
+		sop->event_w_by_fd[ev->ev_fd] = ev;
+	}
+
 	return (0);
 }
 
 /*
- * Nothing to be done here.
  文件句柄，扩大了就没有再缩小了。
  删除信号事件。
  */
@@ -272,8 +384,44 @@ select_del(void *arg, struct event *ev)
 {
 	struct selectop *sop = arg;
 
-	if (!(ev->ev_events & EV_SIGNAL))
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_del(ev));
+
+	if (ev->ev_fd >= sop->event_fdsz / (int)sizeof(fd_mask) * NFDBITS)
 		return (0);
 
-	return (evsignal_del(&sop->evsigmask, ev));
+	if ((ev->ev_events & EV_READ) &&
+	    sop->event_r_by_fd[ev->ev_fd] == ev) {
+		FD_CLR(ev->ev_fd, sop->event_readset_in);
+		sop->event_r_by_fd[ev->ev_fd] = NULL;
+	}
+	if ((ev->ev_events & EV_WRITE) &&
+	    sop->event_w_by_fd[ev->ev_fd] == ev) {
+		FD_CLR(ev->ev_fd, sop->event_writeset_in);
+		sop->event_w_by_fd[ev->ev_fd] = NULL;
+	}
+
+	return (0);
+}
+
+void
+select_dealloc(struct event_base *base, void *arg)
+{
+	struct selectop *sop = arg;
+
+	evsignal_dealloc(base);
+	if (sop->event_readset_in)
+		free(sop->event_readset_in);
+	if (sop->event_writeset_in)
+		free(sop->event_writeset_in);
+	if (sop->event_readset_out)
+		free(sop->event_readset_out);
+	if (sop->event_writeset_out)
+		free(sop->event_writeset_out);
+	if (sop->event_r_by_fd)
+		free(sop->event_r_by_fd);
+	if (sop->event_w_by_fd)
+		free(sop->event_w_by_fd);
+
+	free(sop);
 }
@@ -36,6 +36,9 @@
 #endif
 #include <sys/queue.h>
 #include <sys/socket.h>
+#ifdef HAVE_SYS_SIGNALFD_H
+#include <sys/signalfd.h>
+#endif
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -52,21 +55,11 @@
 #endif
 
 #include "event.h"
+#include "event-internal.h"
 #include "evsignal.h"
 
-extern struct event_list signalqueue;
-
-static short evsigcaught[NSIG];
-static int needrecalc;
-volatile sig_atomic_t evsignal_caught = 0;
-
-void evsignal_process(void);
-int evsignal_recalc(sigset_t *);
-int evsignal_deliver(sigset_t *);
-
-static struct event ev_signal;
-static int ev_signal_pair[2];
-static int ev_signal_added;
+/* Signals are process wide; they are delivered to the base that added one last */
+static struct event_base *evsignal_base = NULL;
 
 /* Callback for when the signal handler write a byte to our signaling socket */
 static void evsignal_cb(int fd, short what, void *arg)
@@ -77,92 +70,289 @@ static void evsignal_cb(int fd, short what, void *arg)
 
 	n = read(fd, signals, sizeof(signals));
 	if (n == -1)
-		err(1, "%s: read");
+		err(1, "%s: read", __func__);
 	event_add(ev, NULL);
 }
 
+#ifdef HAVE_SYS_SIGNALFD_H
+/* Reads the signals that queued up on the signalfd */
+static void evsignal_fd_cb(int fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	struct signalfd_siginfo info[16];
+	ssize_t n;
+	int i;
+
+	do {
+		n = read(fd, info, sizeof(info));
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				log_error("read");
+			break;
+		}
+		for (i = 0; i < n / (ssize_t)sizeof(info[0]); i++)
+			if (info[i].ssi_signo < NSIG)
+				base->sig.evsigcaught[info[i].ssi_signo]++;
+	} while (n == sizeof(info));
+
+	evsignal_process(base);
+}
+
+#endif
+
+/*
+ * The signals stay blocked in the thread running the loop.  Signals
+ * that were deleted are unblocked here, once per change.
+ */
+static int
+evsignal_unblock(struct evsignal_info *sig)
+{
+	sigset_t unblock;
+	int i;
+
+	sigemptyset(&unblock);
+	for (i = 1; i < NSIG; i++)
+		if (sigismember(&sig->evsigblocked, i) &&
+		    !sigismember(&sig->evsigmask, i))
+			sigaddset(&unblock, i);
+
+	if (sigprocmask(SIG_UNBLOCK, &unblock, NULL) == -1)
+		return (-1);
+	sig->evsigblocked = sig->evsigmask;
+
+	return (0);
+}
+
+/* 
+ * Our signal handler is going to write to one end of the socket
+ * pair to wake up our event loop.  The event loop then scans for
+ * signals that got delivered.
+ */
+static void
+evsignal_init_pair(struct event_base *base)
+{
+	struct evsignal_info *sig = &base->sig;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sig->ev_signal_pair) == -1)
+		err(1, "%s: socketpair", __func__);
+
+	event_set(&sig->ev_signal, sig->ev_signal_pair[1], EV_READ,
+	    evsignal_cb, &sig->ev_signal);
+	event_base_set(base, &sig->ev_signal);
+	sig->ev_signal.ev_flags |= EVLIST_INTERNAL;
+}
+
 void
-evsignal_init(sigset_t *evsigmask)
+evsignal_init(struct event_base *base)
 {
-	sigemptyset(evsigmask);
+	struct evsignal_info *sig = &base->sig;
+
+	sigemptyset(&sig->evsigmask);
+	sigemptyset(&sig->evsigblocked);
+	sigemptyset(&sig->evsigwaitmask);
+	sig->ev_signal_fd = -1;
 
-	/* 
-	 * Our signal handler is going to write to one end of the socket
-	 * pair to wake up our event loop.  The event loop then scans for
-	 * signals that got delivered.
+#ifdef HAVE_SYS_SIGNALFD_H
+	/*
+	 * A signalfd is an ordinary fd for the backend, and the signals
+	 * never have to be unblocked and blocked again around the wait.
 	 */
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ev_signal_pair) == -1)
-		err(1, "%s: socketpair", __func__);
+	if (!getenv("EVENT_NOSIGNALFD"))
+		sig->ev_signal_fd = signalfd(-1, &sig->evsigmask,
+		    SFD_NONBLOCK|SFD_CLOEXEC);
+	if (sig->ev_signal_fd != -1) {
+		sig->ev_signal_pair[0] = sig->ev_signal_pair[1] = -1;
+		event_set(&sig->ev_signal, sig->ev_signal_fd,
+		    EV_READ|EV_PERSIST, evsignal_fd_cb, base);
+		event_base_set(base, &sig->ev_signal);
+		sig->ev_signal.ev_flags |= EVLIST_INTERNAL;
+		return;
+	}
+#endif
 
-	event_set(&ev_signal, ev_signal_pair[1], EV_READ,
-	    evsignal_cb, &ev_signal);
-	ev_signal.ev_flags |= EVLIST_INTERNAL;
+	evsignal_init_pair(base);
+}
+
+/*
+ * A signalfd only gets the signals that every thread blocks, and
+ * sigprocmask only blocks them in the calling thread.  Once other threads
+ * may use the base, the signals are caught by the handler instead, which
+ * wakes the loop from whichever thread it runs in.  Signals that are
+ * blocked now stay blocked until the next recalc installs the handlers,
+ * so none of them takes the default action in between.
+ */
+void
+evsignal_enable_threads(struct event_base *base)
+{
+#ifdef HAVE_SYS_SIGNALFD_H
+	struct evsignal_info *sig = &base->sig;
+
+	if (sig->ev_signal_fd == -1)
+		return;
+
+	if (sig->ev_signal_added) {
+		event_del(&sig->ev_signal);
+		sig->ev_signal_added = 0;
+	}
+	close(sig->ev_signal_fd);
+	sig->ev_signal_fd = -1;
+
+	evsignal_init_pair(base);
+	if (TAILQ_FIRST(&base->signalqueue) != NULL)
+		evsignal_base = base;
+	sig->needrecalc = 1;
+#endif
+}
+
+void
+evsignal_dealloc(struct event_base *base)
+{
+	struct evsignal_info *sig = &base->sig;
+
+	if (sig->ev_signal_added) {
+		event_del(&sig->ev_signal);
+		sig->ev_signal_added = 0;
+	}
+
+#ifdef HAVE_SYS_SIGNALFD_H
+	if (sig->ev_signal_fd != -1) {
+		sigprocmask(SIG_UNBLOCK, &sig->evsigblocked, NULL);
+		close(sig->ev_signal_fd);
+		return;
+	}
+#endif
+
+	close(sig->ev_signal_pair[0]);
+	close(sig->ev_signal_pair[1]);
+
+	sigprocmask(SIG_UNBLOCK, &sig->evsigblocked, NULL);
+	if (evsignal_base == base)
+		evsignal_base = NULL;
 }
 
 int
-evsignal_add(sigset_t *evsigmask, struct event *ev)
+evsignal_add(struct event *ev)
 {
+	struct event_base *base = ev->ev_base;
 	int evsignal;
 	
 	if (ev->ev_events & (EV_READ|EV_WRITE))
 		errx(1, "%s: EV_SIGNAL incompatible use", __func__);
 	evsignal = EVENT_SIGNAL(ev);
-	sigaddset(evsigmask, evsignal);
+	sigaddset(&base->sig.evsigmask, evsignal);
+
+#ifdef HAVE_SYS_SIGNALFD_H
+	if (base->sig.ev_signal_fd != -1) {
+		if (signalfd(base->sig.ev_signal_fd, &base->sig.evsigmask,
+			0) == -1)
+			return (-1);
+		/* Block it right away so it cannot take the default action */
+		if (!sigismember(&base->sig.evsigblocked, evsignal)) {
+			sigset_t mask;
+
+			sigemptyset(&mask);
+			sigaddset(&mask, evsignal);
+			if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+				return (-1);
+			sigaddset(&base->sig.evsigblocked, evsignal);
+		}
+		return (0);
+	}
+#endif
+
+	evsignal_base = base;
+	base->sig.needrecalc = 1;
 	
 	return (0);
 }
 
-/*
- * Nothing to be done here.
- */
-
 int
-evsignal_del(sigset_t *evsigmask, struct event *ev)
+evsignal_del(struct event *ev)
 {
+	struct event_base *base = ev->ev_base;
+	struct sigaction sa;
 	int evsignal;
 
 	evsignal = EVENT_SIGNAL(ev);
-	sigdelset(evsigmask, evsignal);
-	needrecalc = 1;
+	sigdelset(&base->sig.evsigmask, evsignal);
+	base->sig.needrecalc = 1;
+
+#ifdef HAVE_SYS_SIGNALFD_H
+	if (base->sig.ev_signal_fd != -1)
+		return (signalfd(base->sig.ev_signal_fd, &base->sig.evsigmask,
+			    0) == -1 ? -1 : 0);
+#endif
 
-	return (sigaction(EVENT_SIGNAL(ev),(struct sigaction *)SIG_DFL, NULL));
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	return (sigaction(evsignal, &sa, NULL));
 }
 
 static void
 evsignal_handler(int sig)
 {
-	evsigcaught[sig]++;
-	evsignal_caught = 1;
+	struct evsignal_info *info;
+
+	if (evsignal_base == NULL)
+		return;
+	info = &evsignal_base->sig;
+
+	info->evsigcaught[sig]++;
+	info->evsignal_caught = 1;
 
 	/* Wake up our notification mechanism */
-	write(ev_signal_pair[0], "a", 1);
+	write(info->ev_signal_pair[0], "a", 1);
 }
 
 int
-evsignal_recalc(sigset_t *evsigmask)
+evsignal_recalc(struct event_base *base)
 {
+	struct evsignal_info *sig = &base->sig;
 	struct sigaction sa;
 	struct event *ev;
+	int i;
 	
-	if (!ev_signal_added) {
-		ev_signal_added = 1;
-		event_add(&ev_signal, NULL);
+	if (!sig->ev_signal_added) {
+		sig->ev_signal_added = 1;
+		event_add(&sig->ev_signal, NULL);
 	}
 
-	if (TAILQ_FIRST(&signalqueue) == NULL && !needrecalc)
+#ifdef HAVE_SYS_SIGNALFD_H
+	if (sig->ev_signal_fd != -1) {
+		if (!sig->needrecalc)
+			return (0);
+		sig->needrecalc = 0;
+		return (evsignal_unblock(sig));
+	}
+#endif
+
+	/* Blocks the signals again after evsignal_deliver */
+	if (sig->evsigunblocked) {
+		sig->evsigunblocked = 0;
+		if (!sig->needrecalc &&
+		    sigprocmask(SIG_BLOCK, &sig->evsigmask, NULL) == -1)
+			return (-1);
+	}
+
+	/* The handlers only need to be installed when the set changed */
+	if (!sig->needrecalc)
 		return (0);
-	needrecalc = 0;
+	sig->needrecalc = 0;
 
-	if (sigprocmask(SIG_BLOCK, evsigmask, NULL) == -1)
+	if (sigprocmask(SIG_BLOCK, &sig->evsigmask, NULL) == -1 ||
+	    evsignal_unblock(sig) == -1 ||
+	    sigprocmask(SIG_BLOCK, NULL, &sig->evsigwaitmask) == -1)
 		return (-1);
+	for (i = 1; i < NSIG; i++)
+		if (sigismember(&sig->evsigmask, i))
+			sigdelset(&sig->evsigwaitmask, i);
 	
-	/* Reinstall our signal handler. */
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = evsignal_handler;
-	sa.sa_mask = *evsigmask;
+	sa.sa_mask = sig->evsigmask;
 	sa.sa_flags |= SA_RESTART;
 	
-	TAILQ_FOREACH(ev, &signalqueue, ev_signal_next) {
+	TAILQ_FOREACH(ev, &base->signalqueue, ev_signal_next) {
 		if (sigaction(EVENT_SIGNAL(ev), &sa, NULL) == -1)
 			return (-1);
 	}
@@ -170,23 +360,42 @@ evsignal_recalc(sigset_t *evsigmask)
 }
 
 int
-evsignal_deliver(sigset_t *evsigmask)
+evsignal_deliver(struct event_base *base)
 {
-	if (TAILQ_FIRST(&signalqueue) == NULL)
+	/* The signalfd is waited on with the signals blocked */
+	if (TAILQ_FIRST(&base->signalqueue) == NULL ||
+	    base->sig.ev_signal_fd != -1)
 		return (0);
 
-	return (sigprocmask(SIG_UNBLOCK, evsigmask, NULL));
-	/* XXX - pending signals handled here */
+	base->sig.evsigunblocked = 1;
+	return (sigprocmask(SIG_UNBLOCK, &base->sig.evsigmask, NULL));
+}
+
+/*
+ * Returns the signal mask for backends that unblock the signals
+ * atomically with the wait, like epoll_pwait(2) and ppoll(2), instead
+ * of calling evsignal_deliver.  NULL leaves the mask alone.
+ */
+const sigset_t *
+evsignal_waitmask(struct event_base *base)
+{
+	if (TAILQ_FIRST(&base->signalqueue) == NULL ||
+	    base->sig.ev_signal_fd != -1)
+		return (NULL);
+
+	return (&base->sig.evsigwaitmask);
 }
 
 void
-evsignal_process(void)
+evsignal_process(struct event_base *base)
 {
-	struct event *ev;
+	struct evsignal_info *sig = &base->sig;
+	struct event *ev, *next;
 	short ncalls;
 
-	TAILQ_FOREACH(ev, &signalqueue, ev_signal_next) {
-		ncalls = evsigcaught[EVENT_SIGNAL(ev)];
+	for (ev = TAILQ_FIRST(&base->signalqueue); ev != NULL; ev = next) {
+		next = TAILQ_NEXT(ev, ev_signal_next);
+		ncalls = sig->evsigcaught[EVENT_SIGNAL(ev)];
 		if (ncalls) {
 			if (!(ev->ev_events & EV_PERSIST))
 				event_del(ev);
@@ -194,7 +403,6 @@ evsignal_process(void)
 		}
 	}
 
-	memset(evsigcaught, 0, sizeof(evsigcaught));
-	evsignal_caught = 0;
+	memset((void *)sig->evsigcaught, 0, sizeof(sig->evsigcaught));
+	sig->evsignal_caught = 0;
 }
-
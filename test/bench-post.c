@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Measures how many callbacks per second producer threads can hand to a
+ * running loop with event_base_post:
+ *
+ *	bench-post -n 1000000 -p 64
+ *
+ * runs with 1, 2, 4, ... up to 64 producers, each posting its share of
+ * the total.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include <event.h>
+
+#ifdef HAVE_LIBPTHREAD
+static struct event_base *base;
+static struct event idle;
+static int num_posts, per_producer, received;
+
+static void
+idle_cb(int fd, short which, void *arg)
+{
+}
+
+static void
+post_cb(void *arg)
+{
+	/* runs in the loop thread, no locking needed */
+	if (++received == num_posts)
+		event_del(&idle);
+}
+
+static void *
+producer(void *arg)
+{
+	int i;
+
+	for (i = 0; i < per_producer; i++) {
+		while (event_base_post(base, post_cb, NULL) == -1)
+			usleep(1000);
+	}
+
+	return (NULL);
+}
+
+static void
+run(int producers)
+{
+	pthread_t *threads;
+	struct timeval ts, te, tv;
+	double usec;
+	int i;
+
+	if ((threads = calloc(producers, sizeof(pthread_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	base = event_base_new();
+	if (event_base_enable_threads(base) == -1) {
+		fprintf(stderr, "event_base_enable_threads failed\n");
+		exit(1);
+	}
+
+	/* Keeps the loop alive until the last post arrived */
+	tv.tv_sec = 3600;
+	tv.tv_usec = 0;
+	evtimer_set(&idle, idle_cb, NULL);
+	event_base_set(base, &idle);
+	evtimer_add(&idle, &tv);
+
+	per_producer = num_posts / producers;
+	num_posts = per_producer * producers;
+	received = 0;
+
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < producers; i++)
+		pthread_create(&threads[i], NULL, producer, NULL);
+	event_base_dispatch(base);
+	gettimeofday(&te, NULL);
+
+	for (i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+	event_base_free(base);
+	free(threads);
+
+	timersub(&te, &ts, &tv);
+	usec = tv.tv_sec * 1000000.0 + tv.tv_usec;
+	fprintf(stdout, "producers %2d %12.0f posts/s\n", producers,
+	    num_posts * 1000000.0 / usec);
+}
+#endif
+
+int
+main (int argc, char **argv)
+{
+#ifdef HAVE_LIBPTHREAD
+	int c, total, max_producers, producers;
+	extern char *optarg;
+
+	total = 1000000;
+	max_producers = 64;
+	while ((c = getopt(argc, argv, "n:p:")) != -1) {
+		switch (c) {
+		case 'n':
+			total = atoi(optarg);
+			break;
+		case 'p':
+			max_producers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+
+	event_init();
+
+	for (producers = 1; producers <= max_producers; producers *= 2) {
+		num_posts = total;
+		run(producers);
+	}
+
+	exit(0);
+#else
+	fprintf(stderr, "%s: needs pthreads\n", argv[0]);
+	exit(1);
+#endif
+}
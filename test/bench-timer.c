@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Measures the cost of the timeout queue with many pending timeouts:
+ *
+ *	bench-timer -n 100000
+ *	bench-timer -n 1000000
+ *	bench-timer -n 1000000 -w 1000
+ *
+ * -w keeps the timeouts in a timing wheel with the given granularity in
+ * microseconds instead of the heap.  -c gives all timeouts the same
+ * duration through a common timeout handle.
+ *
+ * Every line reports the average cost of one operation in nanoseconds.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event.h>
+
+static int num_timers;
+static int fired;
+static struct event *events;
+static struct timeval *common;
+
+static void
+timer_cb(int fd, short which, void *arg)
+{
+	fired++;
+}
+
+/* A timeout far enough in the future that it never fires during a phase */
+static void
+far_timeout(struct timeval *tv)
+{
+	if (common != NULL) {
+		*tv = *common;
+		return;
+	}
+	tv->tv_sec = 60 + random() % 3600;
+	tv->tv_usec = random() % 1000000L;
+}
+
+static void
+report(const char *what, struct timeval *ts, struct timeval *te, int ops)
+{
+	struct timeval tv;
+	double usec;
+
+	timersub(te, ts, &tv);
+	usec = tv.tv_sec * 1000000.0 + tv.tv_usec;
+	fprintf(stdout, "%-8s %8.1f ns/op\n", what, usec * 1000.0 / ops);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct timeval ts, te, tv;
+	struct event_base *base;
+	long wheel = 0;
+	int i, c, usecommon = 0;
+	extern char *optarg;
+
+	num_timers = 100000;
+	while ((c = getopt(argc, argv, "cn:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_timers = atoi(optarg);
+			break;
+		case 'c':
+			usecommon = 1;
+			break;
+		case 'w':
+			wheel = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+
+	events = calloc(num_timers, sizeof(struct event));
+	if (events == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	base = event_init();
+	if (wheel) {
+		tv.tv_sec = wheel / 1000000;
+		tv.tv_usec = wheel % 1000000;
+		if (event_base_timewheel_init(base, &tv) == -1) {
+			fprintf(stderr, "event_base_timewheel_init failed\n");
+			exit(1);
+		}
+	}
+
+	if (usecommon) {
+		tv.tv_sec = 60;
+		tv.tv_usec = 0;
+		common = event_base_init_common_timeout(base, &tv);
+	}
+
+	for (i = 0; i < num_timers; i++)
+		evtimer_set(&events[i], timer_cb, NULL);
+
+	fprintf(stdout, "timers   %d\n", num_timers);
+
+	/* Insert all timeouts */
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers; i++) {
+		far_timeout(&tv);
+		evtimer_add(&events[i], &tv);
+	}
+	gettimeofday(&te, NULL);
+	report("add", &ts, &te, num_timers);
+
+	/* Reschedule every pending timeout, like an idle timer does */
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers; i++) {
+		far_timeout(&tv);
+		evtimer_add(&events[i], &tv);
+	}
+	gettimeofday(&te, NULL);
+	report("readd", &ts, &te, num_timers);
+
+	/* Run the loop while nothing is due: looks up the next timeout */
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < 1000; i++)
+		event_loop(EVLOOP_NONBLOCK);
+	gettimeofday(&te, NULL);
+	report("loop", &ts, &te, 1000);
+
+	/* Let every timeout expire at once and dispatch them */
+	for (i = 0; i < num_timers; i++) {
+		timerclear(&tv);
+		tv.tv_usec = random() % 1000;
+		evtimer_add(&events[i], &tv);
+	}
+	fired = 0;
+	gettimeofday(&ts, NULL);
+	while (fired < num_timers)
+		event_loop(EVLOOP_ONCE);
+	gettimeofday(&te, NULL);
+	report("expire", &ts, &te, num_timers);
+
+	/* Short lived one-shot timers, like retries of requests */
+	fired = 0;
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers; i += 64) {
+		int j, target = fired + 64;
+
+		timerclear(&tv);
+		for (j = 0; j < 64; j++)
+			event_once(-1, EV_TIMEOUT, timer_cb, NULL, &tv);
+		while (fired < target)
+			event_loop(EVLOOP_ONCE);
+	}
+	gettimeofday(&te, NULL);
+	report("once", &ts, &te, fired);
+
+	/* Insert again and remove everything */
+	for (i = 0; i < num_timers; i++) {
+		far_timeout(&tv);
+		evtimer_add(&events[i], &tv);
+	}
+	gettimeofday(&ts, NULL);
+	for (i = 0; i < num_timers; i++)
+		evtimer_del(&events[i]);
+	gettimeofday(&te, NULL);
+	report("del", &ts, &te, num_timers);
+
+	exit(0);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2003, 2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Measures how often housekeeping timers wake up the loop:
+ *
+ *	bench-wakeup -n 10000 -i 1000 -t 5
+ *	bench-wakeup -n 10000 -i 1000 -t 5 -s 10000
+ *	bench-wakeup -n 10000 -i 1000 -t 5 -p
+ *
+ * runs -n timers that rearm themselves every -i milliseconds, plus or
+ * minus ten percent, for -t seconds.  -s sets the timer slack of the
+ * loop in microseconds.  -p makes the timers periodic with EV_PERSIST
+ * instead of adding them again from the callback.  The result is the
+ * number of wakeups and fired timeouts per second, how late the
+ * timeouts fired on average, and the CPU time spent per timeout.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event.h>
+
+struct timer {
+	struct event ev;
+	struct timeval deadline;
+	struct timeval period;
+};
+
+static long interval;
+static int periodic;
+static long fired;
+static double late;
+
+static void
+next_timeout(struct timer *t, struct timeval *now)
+{
+	struct timeval tv;
+	long usec;
+
+	usec = interval * 900 + random() % (interval * 200 + 1);
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	timeradd(now, &tv, &t->deadline);
+	t->period = tv;
+	evtimer_add(&t->ev, &tv);
+}
+
+static void
+timer_cb(int fd, short which, void *arg)
+{
+	struct timer *t = arg;
+	struct timeval now, tv;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &t->deadline, &tv);
+	late += tv.tv_sec * 1000000.0 + tv.tv_usec;
+	fired++;
+
+	if (periodic)
+		timeradd(&t->deadline, &t->period, &t->deadline);
+	else
+		next_timeout(t, &now);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct timeval start, end, now, tv;
+	struct rusage ru;
+	struct event_base *base;
+	struct timer *timers;
+	long slack = 0, wakeups = 0;
+	int i, c, num_timers = 10000, seconds = 5;
+	double elapsed;
+	extern char *optarg;
+
+	interval = 1000;
+	while ((c = getopt(argc, argv, "n:i:ps:t:")) != -1) {
+		switch (c) {
+		case 'p':
+			periodic = 1;
+			break;
+		case 'n':
+			num_timers = atoi(optarg);
+			break;
+		case 'i':
+			interval = atol(optarg);
+			break;
+		case 's':
+			slack = atol(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+
+	timers = calloc(num_timers, sizeof(struct timer));
+	if (timers == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	base = event_init();
+	if (slack) {
+		tv.tv_sec = slack / 1000000;
+		tv.tv_usec = slack % 1000000;
+		if (event_base_set_timer_slack(base, &tv) == -1) {
+			fprintf(stderr, "event_base_set_timer_slack failed\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < num_timers; i++) {
+		gettimeofday(&now, NULL);
+		event_set(&timers[i].ev, -1, periodic ? EV_PERSIST : 0,
+		    timer_cb, &timers[i]);
+		next_timeout(&timers[i], &now);
+	}
+
+	gettimeofday(&start, NULL);
+	end = start;
+	end.tv_sec += seconds;
+	do {
+		event_loop(EVLOOP_ONCE);
+		wakeups++;
+		gettimeofday(&now, NULL);
+	} while (timercmp(&now, &end, <));
+
+	timersub(&now, &start, &tv);
+	elapsed = tv.tv_sec + tv.tv_usec / 1000000.0;
+	fprintf(stdout, "wakeups  %10.1f /s\n", wakeups / elapsed);
+	fprintf(stdout, "fired    %10.1f /s\n", fired / elapsed);
+	fprintf(stdout, "late     %10.1f us\n", fired ? late / fired : 0.0);
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(stdout, "cpu      %10.1f ns/timeout\n", fired ?
+	    (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 / fired +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3 / fired : 0.0);
+
+	return (0);
+}
@@ -56,6 +56,7 @@
 static int count, writes, fired;
 static int *pipes;
 static int num_pipes, num_active, num_writes;
+static short ev_flags = EV_READ | EV_PERSIST;
 static struct event *events;
 
 
@@ -84,8 +85,11 @@ run_once(void)
 
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
 		event_del(&events[i]);
-		event_set(&events[i], cp[0], EV_READ | EV_PERSIST, read_cb, (void *) i);
-		event_add(&events[i], NULL);
+		event_set(&events[i], cp[0], ev_flags, read_cb, (void *) i);
+		if (event_add(&events[i], NULL) == -1) {
+			fprintf(stderr, "event_add failed\n");
+			return (NULL);
+		}
 	}
 
 	event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
@@ -126,7 +130,7 @@ main (int argc, char **argv)
 	num_pipes = 100;
 	num_active = 1;
 	num_writes = num_pipes;
-	while ((c = getopt(argc, argv, "n:a:w:")) != -1) {
+	while ((c = getopt(argc, argv, "n:a:w:e")) != -1) {
 		switch (c) {
 		case 'n':
 			num_pipes = atoi(optarg);
@@ -137,6 +141,10 @@ main (int argc, char **argv)
 		case 'w':
 			num_writes = atoi(optarg);
 			break;
+		case 'e':
+			/* every write is a new edge, read_cb reads one byte */
+			ev_flags |= EV_ET;
+			break;
 		default:
 			fprintf(stderr, "Illegal argument \"%c\"\n", c);
 			exit(1);
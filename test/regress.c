@@ -50,6 +50,10 @@
 #include <string.h>
 #include <errno.h>
 
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #include <event.h>
 
 static int pair[2];
@@ -502,6 +506,958 @@ test9(void)
 	cleanup_test();
 }
 
+void
+test10(void)
+{
+	struct event_base *base1, *base2;
+	struct event ev1, ev2;
+	struct timeval tv;
+
+	setup_test("Multiple bases: ");
+
+	base1 = event_base_new();
+	base2 = event_base_new();
+
+	write(pair[0], TEST1, strlen(TEST1)+1);
+	shutdown(pair[0], SHUT_WR);
+
+	event_set(&ev1, pair[1], EV_READ, simple_read_cb, &ev1);
+	event_base_set(base1, &ev1);
+	event_add(&ev1, NULL);
+
+	/* A pending timeout on the second base must not keep the first busy */
+	tv.tv_usec = 0;
+	tv.tv_sec = 60*60*24;
+	evtimer_set(&ev2, timeout_cb, NULL);
+	event_base_set(base2, &ev2);
+	evtimer_add(&ev2, &tv);
+
+	event_base_dispatch(base1);
+
+	if (!evtimer_pending(&ev2, NULL))
+		test_ok = 0;
+	evtimer_del(&ev2);
+
+	event_base_free(base1);
+	event_base_free(base2);
+
+	cleanup_test();
+}
+
+struct wheel_timer {
+	struct event ev;
+	struct timeval deadline;
+	int order;
+};
+
+static int wheel_fired;
+
+void
+wheel_timeout_cb(int fd, short event, void *arg)
+{
+	struct wheel_timer *wt = arg;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	/* The wheel may round up, but never fire early or out of order */
+	if (timercmp(&now, &wt->deadline, <) || wt->order != wheel_fired)
+		test_ok = 0;
+	wheel_fired++;
+}
+
+void
+test11(void)
+{
+	struct event_base *base;
+	struct wheel_timer wt[5];
+	struct timeval tv, now;
+	/* 1.1s lies beyond level 0 and has to be cascaded; the last is deleted */
+	static int msecs[5] = { 50, 300, 200, 1100, 100 };
+	static int order[5] = { 0, 2, 1, 3, -1 };
+	int i;
+
+	setup_test("Timing wheel: ");
+
+	base = event_base_new();
+	tv.tv_sec = 0;
+	tv.tv_usec = 10 * 1000;
+	if (event_base_timewheel_init(base, &tv) == -1) {
+		fprintf(stdout, "FAILED (init)\n");
+		exit(1);
+	}
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < 5; i++) {
+		evtimer_set(&wt[i].ev, wheel_timeout_cb, &wt[i]);
+		event_base_set(base, &wt[i].ev);
+
+		/* Armed far away first, rearmed below */
+		tv.tv_sec = 3600;
+		tv.tv_usec = 0;
+		evtimer_add(&wt[i].ev, &tv);
+
+		tv.tv_sec = msecs[i] / 1000;
+		tv.tv_usec = (msecs[i] % 1000) * 1000;
+		timeradd(&now, &tv, &wt[i].deadline);
+		wt[i].order = order[i];
+		evtimer_add(&wt[i].ev, &tv);
+	}
+
+	/* Cannot switch while timeouts are pending */
+	if (event_base_timewheel_init(base, &tv) != -1) {
+		fprintf(stdout, "FAILED (busy)\n");
+		exit(1);
+	}
+
+	evtimer_del(&wt[4].ev);
+
+	test_ok = 1;
+	wheel_fired = 0;
+	event_base_dispatch(base);
+
+	if (wheel_fired != 4)
+		test_ok = 0;
+
+	event_base_free(base);
+
+	cleanup_test();
+}
+
+static int common_fired;
+
+void
+common_timeout_cb(int fd, short event, void *arg)
+{
+	struct wheel_timer *wt = arg;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	if (timercmp(&now, &wt->deadline, <) || wt->order != common_fired)
+		test_ok = 0;
+	common_fired++;
+}
+
+void
+test12(void)
+{
+	struct event_base *base;
+	struct wheel_timer wt[4];
+	struct timeval tv, now, *common;
+	int i;
+
+	setup_test("Common timeouts: ");
+
+	base = event_base_new();
+	tv.tv_sec = 0;
+	tv.tv_usec = 100 * 1000;
+	common = event_base_init_common_timeout(base, &tv);
+	if (common == NULL ||
+	    event_base_init_common_timeout(base, &tv) != common ||
+	    event_base_init_common_timeout(base, common) != common) {
+		fprintf(stdout, "FAILED (init)\n");
+		exit(1);
+	}
+
+	for (i = 0; i < 4; i++) {
+		evtimer_set(&wt[i].ev, common_timeout_cb, &wt[i]);
+		event_base_set(base, &wt[i].ev);
+		gettimeofday(&now, NULL);
+		timeradd(&now, &tv, &wt[i].deadline);
+		evtimer_add(&wt[i].ev, common);
+		usleep(10 * 1000);
+	}
+
+	/* Rescheduling moves the first event behind all others */
+	gettimeofday(&now, NULL);
+	timeradd(&now, &tv, &wt[0].deadline);
+	evtimer_add(&wt[0].ev, common);
+	evtimer_del(&wt[2].ev);
+	wt[1].order = 0;
+	wt[3].order = 1;
+	wt[0].order = 2;
+
+	/* The handle must not leak into the reported deadline */
+	test_ok = 0;
+	if (evtimer_pending(&wt[0].ev, &now) && now.tv_usec < 1000000) {
+		struct timeval diff;
+
+		if (timercmp(&now, &wt[0].deadline, >))
+			timersub(&now, &wt[0].deadline, &diff);
+		else
+			timersub(&wt[0].deadline, &now, &diff);
+		if (diff.tv_sec == 0 && diff.tv_usec < 10 * 1000)
+			test_ok = 1;
+	}
+
+	common_fired = 0;
+	event_base_dispatch(base);
+
+	if (common_fired != 3)
+		test_ok = 0;
+
+	event_base_free(base);
+
+	cleanup_test();
+}
+
+static int priority_fired;
+
+void
+priority_cb(int fd, short event, void *arg)
+{
+	int *pri = arg;
+
+	/* all timers expire together; higher priorities have to run first */
+	if (*pri != priority_fired)
+		test_ok = 0;
+	priority_fired++;
+}
+
+void
+test13(void)
+{
+	struct event_base *base;
+	struct event ev[3];
+	struct timeval tv, start, end;
+	static int pri[3] = { 2, 1, 0 };
+	int i;
+
+	setup_test("Priorities: ");
+
+	base = event_base_new();
+	if (event_base_priority_init(base, 3) == -1) {
+		fprintf(stdout, "FAILED (init)\n");
+		exit(1);
+	}
+
+	timerclear(&tv);
+	test_ok = 1;
+	for (i = 0; i < 3; i++) {
+		evtimer_set(&ev[i], priority_cb, &pri[i]);
+		event_base_set(base, &ev[i]);
+		if (event_priority_set(&ev[i], pri[i]) == -1)
+			test_ok = 0;
+		evtimer_add(&ev[i], &tv);
+	}
+
+	if (event_priority_set(&ev[0], 3) != -1)
+		test_ok = 0;
+
+	priority_fired = 0;
+	gettimeofday(&start, NULL);
+	event_base_dispatch(base);
+	gettimeofday(&end, NULL);
+
+	if (priority_fired != 3)
+		test_ok = 0;
+
+	/* Less important events must not wait for the backend to time out */
+	timersub(&end, &start, &tv);
+	if (tv.tv_sec >= 1)
+		test_ok = 0;
+
+	event_base_free(base);
+
+	cleanup_test();
+}
+
+void
+cached_time_cb(int fd, short event, void *arg)
+{
+	struct event_base *base = arg;
+	struct timeval tv1, tv2, now, diff;
+
+	event_base_gettimeofday_cached(base, &tv1);
+	usleep(2 * 1000);
+	event_base_gettimeofday_cached(base, &tv2);
+	gettimeofday(&now, NULL);
+
+	/* same value within one iteration, and not far from the real time */
+	if (timercmp(&tv1, &tv2, !=) || timercmp(&tv1, &now, >))
+		return;
+	timersub(&now, &tv1, &diff);
+	if (diff.tv_sec == 0 && diff.tv_usec < 100 * 1000)
+		test_ok = 1;
+}
+
+void
+test14(void)
+{
+	struct event_base *base;
+	struct event ev;
+	struct timeval tv, tv2;
+
+	setup_test("Cached time: ");
+
+	base = event_base_new();
+	timerclear(&tv);
+	evtimer_set(&ev, cached_time_cb, base);
+	event_base_set(base, &ev);
+	evtimer_add(&ev, &tv);
+	event_base_dispatch(base);
+
+	/* Outside of the loop the clock is read directly */
+	if (test_ok) {
+		event_base_gettimeofday_cached(base, &tv);
+		usleep(2 * 1000);
+		event_base_gettimeofday_cached(base, &tv2);
+		if (!timercmp(&tv, &tv2, <))
+			test_ok = 0;
+	}
+
+	event_base_free(base);
+
+	cleanup_test();
+}
+
+#ifdef HAVE_LIBPTHREAD
+struct thread_test {
+	struct event ev;		/* activated by the thread */
+	struct event idle;		/* keeps the loop waiting */
+	struct event adds[100];		/* added by the thread */
+	struct event busy;		/* keeps the wakeup from being drained */
+	struct timeval start;
+	int posted;
+	volatile int done;
+};
+
+void
+thread_post_cb(void *arg)
+{
+	struct thread_test *tt = arg;
+
+	tt->posted = 1;
+}
+
+void *
+thread_activate(void *arg)
+{
+	struct thread_test *tt = arg;
+	struct timeval tv;
+	int i;
+
+	usleep(100 * 1000);
+
+	/* Wakes the loop, which then only runs the more important event */
+	event_add(&tt->busy, NULL);
+
+	/* The wakeup was not drained yet, so none of these costs another */
+	tv.tv_sec = 10;
+	tv.tv_usec = 0;
+	for (i = 0; i < 100; i++)
+		evtimer_add(&tt->adds[i], &tv);
+
+	event_base_post(tt->ev.ev_base, thread_post_cb, tt);
+
+	for (i = 0; i < 100; i++)
+		event_active(&tt->ev, EV_TIMEOUT, 1);
+
+	tt->done = 1;
+
+	return (NULL);
+}
+
+void
+thread_busy_cb(int fd, short event, void *arg)
+{
+	struct thread_test *tt = arg;
+
+	if (tt->done)
+		event_del(&tt->busy);
+}
+
+void
+thread_activated_cb(int fd, short event, void *arg)
+{
+	struct thread_test *tt = arg;
+	struct timeval now, diff;
+	int i;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &tt->start, &diff);
+
+	/* must not have waited for the idle timer; posts run first */
+	if (diff.tv_sec < 5 && tt->posted)
+		test_ok = 1;
+	event_del(&tt->idle);
+	for (i = 0; i < 100; i++)
+		event_del(&tt->adds[i]);
+}
+
+void
+test15(void)
+{
+	struct event_base *base;
+	struct thread_test tt;
+	struct timeval tv;
+	pthread_t thread;
+	unsigned long wakeups;
+	int i;
+
+	setup_test("Thread wakeup: ");
+
+	base = event_base_new();
+	event_base_priority_init(base, 3);
+	if (event_base_enable_threads(base) == -1) {
+		/* not supported by this backend */
+		fprintf(stdout, "Skipping ");
+		test_ok = 1;
+		event_base_free(base);
+		cleanup_test();
+		return;
+	}
+
+	/* Runs before the internal event that drains the wakeup */
+	event_set(&tt.busy, pair[0], EV_WRITE|EV_PERSIST, thread_busy_cb, &tt);
+	event_base_set(base, &tt.busy);
+	event_priority_set(&tt.busy, 0);
+
+	evtimer_set(&tt.ev, thread_activated_cb, &tt);
+	event_base_set(base, &tt.ev);
+
+	tv.tv_sec = 10;
+	tv.tv_usec = 0;
+	evtimer_set(&tt.idle, timeout_cb, NULL);
+	event_base_set(base, &tt.idle);
+	evtimer_add(&tt.idle, &tv);
+
+	for (i = 0; i < 100; i++) {
+		evtimer_set(&tt.adds[i], timeout_cb, NULL);
+		event_base_set(base, &tt.adds[i]);
+	}
+
+	tt.posted = 0;
+	tt.done = 0;
+	gettimeofday(&tt.start, NULL);
+	pthread_create(&thread, NULL, thread_activate, &tt);
+	event_base_dispatch(base);
+	pthread_join(thread, NULL);
+
+	/* The loop was blocked, so all of them share one wakeup */
+	event_base_thread_stats(base, &wakeups);
+	if (wakeups != 1)
+		test_ok = 0;
+
+	event_base_free(base);
+
+	cleanup_test();
+}
+#endif
+
+void
+edge_read_cb(int fd, short event, void *arg)
+{
+	int *nreads = arg;
+	char ch;
+
+	/* Leaves the rest of the data unread on purpose */
+	if (read(fd, &ch, 1) == 1)
+		(*nreads)++;
+}
+
+void
+test16(void)
+{
+	struct event ev, ev2;
+	const char *method;
+	int nreads = 0, res;
+
+	setup_test("Edge-triggered: ");
+
+	event_set(&ev, pair[1], EV_READ|EV_PERSIST|EV_ET, edge_read_cb, &nreads);
+	if (event_add(&ev, NULL) == -1) {
+		/* not supported by this backend */
+		fprintf(stdout, "Skipping ");
+		test_ok = 1;
+		cleanup_test();
+		return;
+	}
+
+	write(pair[0], TEST1, strlen(TEST1)+1);
+	event_loop(EVLOOP_ONCE);
+	/* Level triggered would report the remaining data again */
+	event_loop(EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	event_loop(EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	if (nreads != 1)
+		goto out;
+
+	/* New data is a new edge */
+	write(pair[0], TEST1, strlen(TEST1)+1);
+	event_loop(EVLOOP_ONCE);
+	if (nreads != 2)
+		goto out;
+
+	/*
+	 * epoll and io_uring refuse mixed trigger modes, io_uring also an
+	 * edge triggered event that is not persistent next to a persistent
+	 * one.  A refused event is not pending.
+	 */
+	method = event_base_get_method(ev.ev_base);
+	event_set(&ev2, pair[1], EV_WRITE, edge_read_cb, &nreads);
+	res = event_add(&ev2, NULL);
+	if (res == -1 && event_pending(&ev2, EV_WRITE, NULL))
+		goto out;
+	if (res != -1 &&
+	    (!strcmp(method, "epoll") || !strcmp(method, "io_uring")))
+		goto out;
+	event_del(&ev2);
+
+	event_set(&ev2, pair[1], EV_WRITE|EV_ET, edge_read_cb, &nreads);
+	res = event_add(&ev2, NULL);
+	if (res == -1 && event_pending(&ev2, EV_WRITE, NULL))
+		goto out;
+	if (res != -1 && !strcmp(method, "io_uring"))
+		goto out;
+	event_del(&ev2);
+	test_ok = 1;
+
+ out:
+	event_del(&ev);
+	cleanup_test();
+}
+
+void
+completion_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what == (EVBUFFER_READ|EVBUFFER_EOF)) {
+		bufferevent_disable(bev, EV_READ);
+		test_ok++;
+	} else
+		test_ok = -2;
+}
+
+void
+test17(void)
+{
+	struct bufferevent *bev1, *bev2;
+	struct event ev;
+	char buffer[4096];
+	int i;
+
+	setup_test("Completion bufferevent: ");
+
+	bev1 = bufferevent_new(pair[0], readcb, writecb, errorcb, NULL);
+	bev2 = bufferevent_new(pair[1], readcb, writecb, completion_errorcb,
+	    NULL);
+
+	if (bufferevent_use_completion(bev1) == -1 ||
+	    bufferevent_use_completion(bev2) == -1) {
+		/* not supported by this backend */
+		fprintf(stdout, "Skipping ");
+		bufferevent_free(bev1);
+		bufferevent_free(bev2);
+		test_ok = 1;
+		cleanup_test();
+		return;
+	}
+
+	bufferevent_disable(bev1, EV_READ);
+	bufferevent_enable(bev2, EV_READ);
+
+	for (i = 0; i < sizeof(buffer); i++)
+		buffer[i] = i;
+
+	bufferevent_write(bev1, buffer, sizeof(buffer));
+
+	event_dispatch();
+
+	if (test_ok != 2 ||
+	    memcmp(EVBUFFER_DATA(bev2->input), buffer, sizeof(buffer)) != 0) {
+		test_ok = 0;
+		goto out;
+	}
+
+	/* The end of the stream comes through the error callback */
+	shutdown(pair[0], SHUT_WR);
+	bufferevent_enable(bev2, EV_READ);
+
+	event_dispatch();
+
+	test_ok = test_ok == 3;
+
+	/* A refused completion event must not be left pending */
+	event_set(&ev, pair[1], EV_READ|EV_WRITE|EV_COMPLETION, edge_read_cb,
+	    NULL);
+	ev.ev_buffer = bev2->input;
+	if (event_add(&ev, NULL) != -1 ||
+	    event_pending(&ev, EV_READ|EV_WRITE, NULL))
+		test_ok = 0;
+
+ out:
+	bufferevent_free(bev1);
+	bufferevent_free(bev2);
+
+	cleanup_test();
+}
+
+static int slack_fired;
+
+void
+slack_timeout_cb(int fd, short event, void *arg)
+{
+	struct timeval *deadline = arg;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	/* Slack only ever delays a timeout */
+	if (timercmp(&now, deadline, <))
+		test_ok = 0;
+	slack_fired++;
+}
+
+void
+test18(void)
+{
+	struct event_base *base;
+	struct event ev[5];
+	struct timeval deadline[5], tv, now;
+	int i, wakeups = 0;
+
+	setup_test("Timer slack: ");
+
+	base = event_base_new();
+	tv.tv_sec = 0;
+	tv.tv_usec = 200 * 1000;
+	if (event_base_set_timer_slack(base, &tv) == -1) {
+		fprintf(stdout, "FAILED (init)\n");
+		exit(1);
+	}
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < 5; i++) {
+		evtimer_set(&ev[i], slack_timeout_cb, &deadline[i]);
+		event_base_set(base, &ev[i]);
+		tv.tv_sec = 0;
+		tv.tv_usec = (i + 1) * 10 * 1000;
+		timeradd(&now, &tv, &deadline[i]);
+		evtimer_add(&ev[i], &tv);
+	}
+
+	/* 40ms of deadlines fall into at most two periods of 200ms */
+	test_ok = 1;
+	slack_fired = 0;
+	while (slack_fired < 5) {
+		event_base_loop(base, EVLOOP_ONCE);
+		wakeups++;
+	}
+	if (wakeups > 2)
+		test_ok = 0;
+
+	event_base_free(base);
+
+	cleanup_test();
+}
+
+struct periodic_test {
+	struct event ev;
+	struct timeval start;
+	struct timeval period;
+	int fired;
+};
+
+void
+periodic_timeout_cb(int fd, short event, void *arg)
+{
+	struct periodic_test *pt = arg;
+	struct timeval now, deadline;
+	int i;
+
+	gettimeofday(&now, NULL);
+
+	/* The n-th call is due n periods after the start */
+	deadline = pt->start;
+	for (i = 0; i <= pt->fired; i++)
+		timeradd(&deadline, &pt->period, &deadline);
+	if (timercmp(&now, &deadline, <))
+		test_ok = 0;
+
+	if (++pt->fired == 10) {
+		event_del(&pt->ev);
+		return;
+	}
+
+	/* Time spent in the callback must not delay the next call */
+	usleep(20 * 1000);
+}
+
+static void
+periodic_run(struct event_base *base, struct timeval *period)
+{
+	struct periodic_test pt;
+	struct timeval tv;
+
+	event_set(&pt.ev, -1, EV_PERSIST, periodic_timeout_cb, &pt);
+	event_base_set(base, &pt.ev);
+	pt.fired = 0;
+	pt.period.tv_sec = 0;
+	pt.period.tv_usec = 50 * 1000;
+	gettimeofday(&pt.start, NULL);
+	event_add(&pt.ev, period);
+
+	event_base_dispatch(base);
+
+	/* Rearming from the callback would take 10 * 70ms */
+	gettimeofday(&tv, NULL);
+	timersub(&tv, &pt.start, &tv);
+	if (pt.fired != 10 || tv.tv_sec > 0 || tv.tv_usec > 650 * 1000)
+		test_ok = 0;
+}
+
+void
+test19(void)
+{
+	struct event_base *base;
+	struct timeval tv;
+
+	setup_test("Periodic timer: ");
+
+	test_ok = 1;
+	tv.tv_sec = 0;
+	tv.tv_usec = 50 * 1000;
+
+	base = event_base_new();
+	periodic_run(base, &tv);
+	periodic_run(base, event_base_init_common_timeout(base, &tv));
+	event_base_free(base);
+
+	base = event_base_new();
+	tv.tv_usec = 1000;
+	event_base_timewheel_init(base, &tv);
+	tv.tv_usec = 50 * 1000;
+	periodic_run(base, &tv);
+	event_base_free(base);
+
+	cleanup_test();
+}
+
+void
+busy_poll_read_cb(int fd, short event, void *arg)
+{
+	char buf[256];
+
+	if (read(fd, buf, sizeof(buf)) > 0)
+		(*(int *)arg)++;
+}
+
+void
+busy_poll_timeout_cb(int fd, short event, void *arg)
+{
+}
+
+void
+test20(void)
+{
+	struct event_base *base;
+	struct event ev, timeout;
+	struct timeval tv, start, now;
+	unsigned long hits, sleeps;
+	int nreads = 0;
+
+	setup_test("Busy poll: ");
+
+	base = event_base_new();
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if (event_base_set_busy_poll(base, &tv) != -1)
+		goto out;
+	tv.tv_sec = 0;
+	tv.tv_usec = 10 * 1000;
+	if (event_base_set_busy_poll(base, &tv) == -1)
+		goto out;
+
+	event_set(&ev, pair[1], EV_READ|EV_PERSIST, busy_poll_read_cb, &nreads);
+	event_base_set(base, &ev);
+	event_add(&ev, NULL);
+	evtimer_set(&timeout, busy_poll_timeout_cb, NULL);
+	event_base_set(base, &timeout);
+
+	/* Found while spinning */
+	write(pair[0], TEST1, strlen(TEST1)+1);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&timeout, &tv);
+	event_base_loop(base, EVLOOP_ONCE);
+	event_base_busy_poll_stats(base, &hits, &sleeps);
+	if (nreads != 1 || hits != 1 || sleeps != 0)
+		goto out;
+
+	/* Nothing arrives within the budget; the timeout still fires */
+	tv.tv_sec = 0;
+	tv.tv_usec = 50 * 1000;
+	evtimer_add(&timeout, &tv);
+	gettimeofday(&start, NULL);
+	event_base_loop(base, EVLOOP_ONCE);
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &now);
+	event_base_busy_poll_stats(base, &hits, &sleeps);
+	if (hits == 1 && sleeps == 1 && !evtimer_pending(&timeout, NULL) &&
+	    timercmp(&now, &tv, >=))
+		test_ok = 1;
+
+ out:
+	event_del(&ev);
+	event_del(&timeout);
+	event_base_free(base);
+	cleanup_test();
+}
+
+void
+test21(void)
+{
+	struct event ev;
+	FILE *fp;
+	int nreads = 0;
+
+	setup_test("Regular file: ");
+
+	if ((fp = tmpfile()) == NULL) {
+		fprintf(stdout, "FAILED (tmpfile)\n");
+		exit(1);
+	}
+
+	/*
+	 * Backends either refuse regular files or report them readable
+	 * right away; an event that is accepted but never fires is lost.
+	 */
+	event_set(&ev, fileno(fp), EV_READ, edge_read_cb, &nreads);
+	if (event_add(&ev, NULL) == -1) {
+		if (!event_pending(&ev, EV_READ, NULL))
+			test_ok = 1;
+	} else {
+		event_loop(EVLOOP_ONCE|EVLOOP_NONBLOCK);
+		if (!event_pending(&ev, EV_READ, NULL))
+			test_ok = 1;
+		event_del(&ev);
+	}
+
+	fclose(fp);
+	cleanup_test();
+}
+
+#ifdef HAVE_LIBPTHREAD
+void *
+thread_signal(void *arg)
+{
+	sigset_t mask;
+
+	usleep(100 * 1000);
+
+	/* A thread the library does not know about, not blocking it */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+	pthread_kill(pthread_self(), SIGUSR1);
+
+	return (NULL);
+}
+
+void
+thread_signal_cb(int fd, short event, void *arg)
+{
+	struct event_base *base = arg;
+
+	/* The idle timer only ends the loop if the signal got lost */
+	if (event & EV_SIGNAL)
+		test_ok = 1;
+	event_base_loopexit(base, NULL);
+}
+
+void
+test22(void)
+{
+	struct event_base *base;
+	struct event ev, idle;
+	struct timeval tv;
+	pthread_t thread;
+
+	setup_test("Thread signal: ");
+
+	base = event_base_new();
+	if (event_base_enable_threads(base) == -1) {
+		/* not supported by this backend */
+		fprintf(stdout, "Skipping ");
+		test_ok = 1;
+		event_base_free(base);
+		cleanup_test();
+		return;
+	}
+
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	evtimer_set(&idle, thread_signal_cb, base);
+	event_base_set(base, &idle);
+	evtimer_add(&idle, &tv);
+
+	signal_set(&ev, SIGUSR1, thread_signal_cb, base);
+	event_base_set(base, &ev);
+	signal_add(&ev, NULL);
+
+	pthread_create(&thread, NULL, thread_signal, NULL);
+	event_base_dispatch(base);
+	pthread_join(thread, NULL);
+
+	signal_del(&ev);
+	evtimer_del(&idle);
+	event_base_free(base);
+
+	cleanup_test();
+}
+#endif
+
+void
+closed_fd_cb(int fd, short event, void *arg)
+{
+	short *what = arg;
+
+	*what = event;
+}
+
+void
+test23(void)
+{
+	struct event ev;
+	struct timeval tv;
+	const char *method;
+	short what = 0;
+	int fd;
+
+	setup_test("Closed descriptor: ");
+
+	if ((fd = dup(pair[0])) == -1) {
+		fprintf(stdout, "FAILED (dup)\n");
+		exit(1);
+	}
+	close(fd);
+
+	event_set(&ev, fd, EV_READ, closed_fd_cb, &what);
+	method = event_base_get_method(ev.ev_base);
+	if (strcmp(method, "epoll") && strcmp(method, "io_uring")) {
+		/* poll and select report bad descriptors as loop errors */
+		fprintf(stdout, "Skipping ");
+		test_ok = 1;
+		cleanup_test();
+		return;
+	}
+
+	/* Either event_add fails or the callback sees the error */
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	if (event_add(&ev, &tv) == -1) {
+		if (!event_pending(&ev, EV_READ, NULL))
+			test_ok = 1;
+	} else {
+		event_loop(EVLOOP_ONCE);
+		if (what == EV_READ && !event_pending(&ev, EV_READ, NULL))
+			test_ok = 1;
+		event_del(&ev);
+	}
+
+	cleanup_test();
+}
+
 int
 main (int argc, char **argv)
 {
@@ -538,6 +1494,38 @@ main (int argc, char **argv)
 
 	test9();
 
+	test10();
+
+	test11();
+
+	test12();
+
+	test13();
+
+	test14();
+
+#ifdef HAVE_LIBPTHREAD
+	test15();
+#endif
+
+	test16();
+
+	test17();
+
+	test18();
+
+	test19();
+
+	test20();
+
+	test21();
+
+#ifdef HAVE_LIBPTHREAD
+	test22();
+#endif
+
+	test23();
+
 	return (0);
 }
 
@@ -5,6 +5,7 @@ setup () {
 	 export EVENT_NOPOLL=yes
 	 export EVENT_NOSELECT=yes
 	 export EVENT_NOEPOLL=yes
+	 export EVENT_NOIOURING=yes
 	 export EVENT_NORTSIG=yes
 }
 
@@ -73,5 +74,17 @@ unset EVENT_NOEPOLL
 echo "EPOLL"
 test
 
+setup
+unset EVENT_NOIOURING
+echo "IOURING"
+test
+
+setup
+unset EVENT_NOEPOLL
+export EVENT_NOSIGNALFD=yes
+echo "EPOLL (no signalfd)"
+test
+unset EVENT_NOSIGNALFD
+
 
 
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#undef WIN32_LEAN_AND_MEAN
+#include "misc.h"
+#endif
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_time.h>
+#endif
+#include <sys/queue.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <err.h>
+
+#include "event.h"
+#include "event-internal.h"
+
+#define TW_SLOT(level, idx)	((level) * TIMEWHEEL_SIZE + (idx))
+#define TW_INDEX(tick, level)	\
+	((unsigned int)((tick) >> ((level) * TIMEWHEEL_BITS)) & TIMEWHEEL_MASK)
+
+/* Ticks covered by all levels together */
+#define TW_RANGE	((u_int64_t)1 << (TIMEWHEEL_LEVELS * TIMEWHEEL_BITS))
+
+/* Converts an absolute time into a tick, rounded up so we never fire early */
+static u_int64_t
+timewheel_tick(struct timewheel *tw, struct timeval *tv, int roundup)
+{
+	struct timeval off;
+	u_int64_t usec;
+
+	if (timercmp(tv, &tw->tw_start, <))
+		return (0);
+
+	timersub(tv, &tw->tw_start, &off);
+	usec = (u_int64_t)off.tv_sec * 1000000 + off.tv_usec;
+	if (roundup)
+		usec += tw->tw_tick - 1;
+
+	return (usec / tw->tw_tick);
+}
+
+static void
+timewheel_tick_to_tv(struct timewheel *tw, u_int64_t tick, struct timeval *tv)
+{
+	struct timeval off;
+	u_int64_t usec = tick * tw->tw_tick;
+
+	off.tv_sec = usec / 1000000;
+	off.tv_usec = usec % 1000000;
+	timeradd(&tw->tw_start, &off, tv);
+}
+
+struct timewheel *
+timewheel_new(struct timeval *granularity)
+{
+	struct timewheel *tw;
+	int i;
+
+	if ((tw = calloc(1, sizeof(struct timewheel))) == NULL)
+		return (NULL);
+
+	tw->tw_tick = granularity->tv_sec * 1000000 + granularity->tv_usec;
+	event_gettime(&tw->tw_start);
+
+	for (i = 0; i < TIMEWHEEL_LEVELS * TIMEWHEEL_SIZE; i++)
+		TAILQ_INIT(&tw->tw_slots[i]);
+
+	return (tw);
+}
+
+void
+timewheel_free(struct timewheel *tw)
+{
+	if (tw->tw_count)
+		errx(1, "%s: %d timeouts still pending", __func__,
+		    tw->tw_count);
+	free(tw);
+}
+
+/* Links the event into the slot that matches its expiration tick */
+static void
+timewheel_link(struct timewheel *tw, struct event *ev)
+{
+	u_int64_t expires = timewheel_tick(tw, &ev->ev_timeout, 1);
+	u_int64_t delta;
+	unsigned int slot;
+	int level;
+
+	if (expires < tw->tw_cur)
+		expires = tw->tw_cur;
+	delta = expires - tw->tw_cur;
+
+	/* Timeouts beyond the last level wait in it and get cascaded again */
+	if (delta >= TW_RANGE) {
+		delta = TW_RANGE - 1;
+		expires = tw->tw_cur + delta;
+	}
+
+	for (level = 0; level < TIMEWHEEL_LEVELS - 1; level++)
+		if (delta < ((u_int64_t)1 << ((level + 1) * TIMEWHEEL_BITS)))
+			break;
+
+	slot = TW_SLOT(level, TW_INDEX(expires, level));
+	ev->ev_timeout_pos.list.ev_timeout_slot = slot;
+	TAILQ_INSERT_TAIL(&tw->tw_slots[slot], ev,
+	    ev_timeout_pos.list.ev_timeout_next);
+	tw->tw_nlevel[level]++;
+}
+
+void
+timewheel_insert(struct timewheel *tw, struct event *ev)
+{
+	/* An idle wheel does not need to catch up with the clock */
+	if (tw->tw_count == 0) {
+		struct timeval now;
+
+		event_gettime(&now);
+		tw->tw_cur = timewheel_tick(tw, &now, 0);
+	}
+
+	timewheel_link(tw, ev);
+	tw->tw_count++;
+}
+
+void
+timewheel_remove(struct timewheel *tw, struct event *ev)
+{
+	unsigned int slot = ev->ev_timeout_pos.list.ev_timeout_slot;
+
+	TAILQ_REMOVE(&tw->tw_slots[slot], ev,
+	    ev_timeout_pos.list.ev_timeout_next);
+	tw->tw_nlevel[slot / TIMEWHEEL_SIZE]--;
+	tw->tw_count--;
+}
+
+/*
+ * Computes the time of the next tick that needs attention: either the
+ * first non-empty slot of level 0 or the earliest cascade of a non-empty
+ * upper level slot.  Returns 0 if the wheel is empty.
+ */
+int
+timewheel_next(struct timewheel *tw, struct timeval *now, struct timeval *tv)
+{
+	u_int64_t tick = 0, when_tick;
+	unsigned int i, idx, first;
+	int level, shift, found = 0;
+	struct timeval when;
+
+	if (tw->tw_count == 0)
+		return (0);
+
+	if (tw->tw_nlevel[0]) {
+		idx = TW_INDEX(tw->tw_cur, 0);
+		for (i = 0; i < TIMEWHEEL_SIZE; i++) {
+			if (TAILQ_FIRST(&tw->tw_slots[TW_SLOT(0,
+				    (idx + i) & TIMEWHEEL_MASK)])) {
+				tick = tw->tw_cur + i;
+				found = 1;
+				break;
+			}
+		}
+	}
+
+	for (level = 1; level < TIMEWHEEL_LEVELS; level++) {
+		if (!tw->tw_nlevel[level])
+			continue;
+		shift = level * TIMEWHEEL_BITS;
+		idx = TW_INDEX(tw->tw_cur, level);
+		/* On a boundary, the current slot has not been cascaded yet */
+		first = (tw->tw_cur & (((u_int64_t)1 << shift) - 1)) != 0;
+		for (i = first; i < first + TIMEWHEEL_SIZE; i++) {
+			if (!TAILQ_FIRST(&tw->tw_slots[TW_SLOT(level,
+				    (idx + i) & TIMEWHEEL_MASK)]))
+				continue;
+			when_tick = ((tw->tw_cur >> shift) + i) << shift;
+			if (!found || when_tick < tick)
+				tick = when_tick;
+			found = 1;
+			break;
+		}
+	}
+
+	timewheel_tick_to_tv(tw, tick, &when);
+	if (timercmp(&when, now, <=))
+		timerclear(tv);
+	else
+		timersub(&when, now, tv);
+
+	return (1);
+}
+
+/* Time went backwards; shift the wheel and all its deadlines along */
+void
+timewheel_correct(struct timewheel *tw, struct timeval *off)
+{
+	struct event *ev;
+	int i;
+
+	timersub(&tw->tw_start, off, &tw->tw_start);
+	for (i = 0; i < TIMEWHEEL_LEVELS * TIMEWHEEL_SIZE; i++) {
+		TAILQ_FOREACH(ev, &tw->tw_slots[i],
+		    ev_timeout_pos.list.ev_timeout_next)
+			timersub(&ev->ev_timeout, off, &ev->ev_timeout);
+	}
+}
+
+/* Moves the events of an upper level slot down to where they belong now */
+static void
+timewheel_cascade(struct timewheel *tw, int level)
+{
+	struct event_list *head, pending;
+	struct event *ev;
+
+	/* Detach first; far timeouts may land in the same slot again */
+	TAILQ_INIT(&pending);
+	head = &tw->tw_slots[TW_SLOT(level, TW_INDEX(tw->tw_cur, level))];
+	while ((ev = TAILQ_FIRST(head)) != NULL) {
+		TAILQ_REMOVE(head, ev, ev_timeout_pos.list.ev_timeout_next);
+		TAILQ_INSERT_TAIL(&pending, ev,
+		    ev_timeout_pos.list.ev_timeout_next);
+		tw->tw_nlevel[level]--;
+	}
+
+	while ((ev = TAILQ_FIRST(&pending)) != NULL) {
+		TAILQ_REMOVE(&pending, ev, ev_timeout_pos.list.ev_timeout_next);
+		timewheel_link(tw, ev);
+	}
+}
+
+void
+timewheel_process(struct timewheel *tw, struct timeval *now)
+{
+	u_int64_t last = timewheel_tick(tw, now, 0);
+	struct event_list *head;
+	struct event *ev;
+	int level;
+
+	while (tw->tw_cur <= last) {
+		if (tw->tw_count == 0) {
+			tw->tw_cur = last + 1;
+			break;
+		}
+
+		/* Nothing to expire on level 0, skip to the next cascade */
+		if (tw->tw_nlevel[0] == 0 && TW_INDEX(tw->tw_cur, 0) != 0) {
+			tw->tw_cur = (tw->tw_cur | TIMEWHEEL_MASK) + 1;
+			if (tw->tw_cur > last + 1)
+				tw->tw_cur = last + 1;
+			continue;
+		}
+
+		/* Refill the lower levels each time a level wraps around */
+		for (level = 1; level < TIMEWHEEL_LEVELS; level++) {
+			if (TW_INDEX(tw->tw_cur, level - 1) != 0)
+				break;
+			if (tw->tw_nlevel[level])
+				timewheel_cascade(tw, level);
+		}
+
+		head = &tw->tw_slots[TW_SLOT(0, TW_INDEX(tw->tw_cur, 0))];
+		/* removes the timeout from the slot, or moves it further */
+		while ((ev = TAILQ_FIRST(head)) != NULL)
+			event_timeout_expire(ev, now);
+
+		tw->tw_cur++;
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TIMEWHEEL_H_
+#define _TIMEWHEEL_H_
+
+/*
+ * Hierarchical timing wheel.  Level 0 has one slot per tick, every
+ * further level covers TIMEWHEEL_SIZE slots of the level below it.
+ * Events are linked into a slot list, so arming, re-arming and
+ * cancelling a timeout are O(1); entries of the upper levels are
+ * redistributed to the lower ones whenever a level wraps around.
+ */
+#define TIMEWHEEL_BITS		6
+#define TIMEWHEEL_SIZE		(1 << TIMEWHEEL_BITS)
+#define TIMEWHEEL_MASK		(TIMEWHEEL_SIZE - 1)
+#define TIMEWHEEL_LEVELS	4
+
+struct timewheel {
+	struct timeval tw_start;	/* time of tick 0 */
+	long tw_tick;			/* granularity in microseconds */
+	u_int64_t tw_cur;		/* next tick to be expired */
+	unsigned int tw_count;		/* events in all levels */
+	unsigned int tw_nlevel[TIMEWHEEL_LEVELS];
+
+	struct event_list tw_slots[TIMEWHEEL_LEVELS * TIMEWHEEL_SIZE];
+};
+
+struct timewheel *timewheel_new(struct timeval *);
+void timewheel_free(struct timewheel *);
+void timewheel_insert(struct timewheel *, struct event *);
+void timewheel_remove(struct timewheel *, struct event *);
+int timewheel_next(struct timewheel *, struct timeval *, struct timeval *);
+void timewheel_correct(struct timewheel *, struct timeval *);
+void timewheel_process(struct timewheel *, struct timeval *);
+
+#endif /* _TIMEWHEEL_H_ */